@@ -1,11 +1,44 @@
 #include "CacheZone.h"
+#include "lz4.h"
 #include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <stdexcept>
 
-CacheZone::CacheZone(size_t maxBlocks)
-: m_maxBlocks(maxBlocks)
+CacheZone::CacheZone(size_t maxBlocks, size_t blockSize)
+: m_maxBlocks(maxBlocks), m_blockSize(0)
 {
+	setBlockSize(blockSize);
+}
+
+void CacheZone::setBlockSize(size_t blockSize)
+{
+	if (blockSize == 0 || (blockSize & (blockSize - 1)) != 0 || blockSize > UINT32_MAX)
+		throw std::logic_error("Cache block size must be a power of two");
+	
+	if (blockSize == m_blockSize)
+		return;
+	
+	m_blockSize = blockSize;
+	
+	// Drop everything, the block IDs don't mean the same anymore
+	m_cache.clear();
+	m_cacheAge.clear();
+	m_compressed.clear();
+	m_compressedAge.clear();
+	m_compressedBytes = 0;
+	for (auto it = m_tags.begin(); it != m_tags.end(); )
+	{
+		it->second.blocks.clear();
+		
+		if (it->second.users == 0)
+		{
+			m_tagIds.erase(it->second.name);
+			it = m_tags.erase(it);
+		}
+		else
+			++it;
+	}
 }
 
 void CacheZone::setMaxBlocks(size_t max)
@@ -14,30 +47,110 @@ void CacheZone::setMaxBlocks(size_t max)
 	evictCache();
 }
 
-void CacheZone::store(const std::string& vfile, uint64_t blockId, const uint8_t* data, size_t bytes)
+void CacheZone::setCompressedLimit(size_t bytes)
+{
+	m_compressedLimit = bytes;
+	evictCache();
+}
+
+CacheZone::TagId CacheZone::acquireTag(const std::string& tag)
+{
+	auto it = m_tagIds.find(tag);
+	
+	if (it == m_tagIds.end())
+	{
+		it = m_tagIds.insert({ tag, m_nextTag++ }).first;
+		m_tags[it->second].name = tag;
+		m_tags[it->second].users = 0;
+	}
+	
+	m_tags[it->second].users++;
+	return it->second;
+}
+
+void CacheZone::releaseTag(TagId tag)
+{
+	auto it = m_tags.find(tag);
+	
+	// Called from destructors, so don't throw
+	if (it == m_tags.end() || it->second.users == 0)
+		return;
+	
+	it->second.users--;
+	
+	// Blocks stay cached, a reader of the same tag created later gets them
+	forgetTagIfUnused(tag);
+}
+
+void CacheZone::forgetTagIfUnused(TagId tag)
+{
+	auto it = m_tags.find(tag);
+	
+	if (it != m_tags.end() && it->second.users == 0 && it->second.blocks.empty())
+	{
+		m_tagIds.erase(it->second.name);
+		m_tags.erase(it);
+	}
+}
+
+void CacheZone::store(TagId tag, uint64_t blockId, const uint8_t* data, size_t offset, size_t bytes)
 {
-	CacheKey key = CacheKey(blockId, vfile);
-	CacheEntry entry;
-	std::unordered_map<CacheKey, CacheEntry>::iterator it;
+	CacheKey key = CacheKey{ blockId, tag };
+	std::pair<Cache::iterator, bool> ins;
 
 #ifdef DEBUG
-	std::cout << "CacheZone::store(): blockId=" << blockId << ", bytes=" << bytes << std::endl;
+	std::cout << "CacheZone::store(): blockId=" << blockId << ", offset=" << offset << ", bytes=" << bytes << std::endl;
 #endif
 	
-	std::copy(data, data+bytes, entry.data.begin());
+	if (offset + bytes > m_blockSize)
+		throw std::logic_error("CacheZone::store(): data exceeds the block");
+	
+	Cache::iterator it = findBlock(key);
+	
+	if (it == m_cache.end())
+		ins = m_cache.insert({ key, CacheEntry() });
+	else
+		ins = std::make_pair(it, false);
+	
+	CacheEntry& entry = ins.first->second;
+	
+	if (ins.second)
+	{
+		std::list<uint64_t>& blocks = m_tags[tag].blocks;
+		
+		blocks.push_back(blockId);
+		entry.itTagBlocks = --blocks.end();
+		entry.data.reset(new uint8_t[m_blockSize]);
+		entry.validFrom = entry.validTo = offset;
+	}
+	else
+		m_cacheAge.erase(entry.itAge);
+	
+	memcpy(&entry.data[offset], data, bytes);
+	
+	if (offset <= entry.validTo && offset + bytes >= entry.validFrom)
+	{
+		entry.validFrom = std::min<uint32_t>(entry.validFrom, offset);
+		entry.validTo = std::max<uint32_t>(entry.validTo, offset + bytes);
+	}
+	else
+	{
+		// Not contiguous with what we had, keep the newer piece only
+		entry.validFrom = offset;
+		entry.validTo = offset + bytes;
+	}
 	
-	it = m_cache.insert(m_cache.begin(), { key, entry });
 	m_cacheAge.push_back(key);
-	it->second.itAge = --m_cacheAge.end();
+	entry.itAge = --m_cacheAge.end();
 	
 	if (m_cache.size() > m_maxBlocks)
 		evictCache();
 }
 
-size_t CacheZone::get(const std::string& vfile, uint64_t blockId, uint8_t* data, size_t offset, size_t maxBytes)
+size_t CacheZone::get(TagId tag, uint64_t blockId, uint8_t* data, size_t offset, size_t maxBytes)
 {
-	CacheKey key = CacheKey(blockId, vfile);
-	auto it = m_cache.find(key);
+	CacheKey key = CacheKey{ blockId, tag };
+	auto it = findBlock(key);
 
 #ifdef DEBUG
 	std::cout << "CacheZone::get(): blockId=" << blockId << ", offset=" << offset << ", maxBytes=" << maxBytes << std::endl;
@@ -45,26 +158,241 @@ size_t CacheZone::get(const std::string& vfile, uint64_t blockId, uint8_t* data,
 	
 	m_queries++;
 	
-	if (it == m_cache.end())
+	if (it == m_cache.end() || offset < it->second.validFrom || offset >= it->second.validTo)
 		return 0;
 	
-	maxBytes = std::min(it->second.data.size() - offset, maxBytes);
+	maxBytes = std::min<size_t>(it->second.validTo - offset, maxBytes);
 	memcpy(data, &it->second.data[offset], maxBytes);
 	
-	m_cacheAge.erase(it->second.itAge);
-	m_cacheAge.push_back(key);
-	it->second.itAge = --m_cacheAge.end();
+	m_cacheAge.splice(m_cacheAge.end(), m_cacheAge, it->second.itAge);
 	m_hits++;
 	
+	// A block decompressed by findBlock() may have pushed the zone over its limit
+	evictCache();
+	
 	return maxBytes;
 }
 
+bool CacheZone::contains(TagId tag, uint64_t offset, uint64_t count) const
+{
+	const uint64_t end = offset + count;
+	
+	for (uint64_t pos = offset; pos < end; )
+	{
+		const size_t blockOffset = pos & (m_blockSize - 1);
+		const size_t thistime = std::min<uint64_t>(m_blockSize - blockOffset, end - pos);
+		const CacheKey key = CacheKey{ pos / m_blockSize, tag };
+		auto it = m_cache.find(key);
+		uint32_t validFrom, validTo;
+		
+		if (it != m_cache.end())
+		{
+			validFrom = it->second.validFrom;
+			validTo = it->second.validTo;
+		}
+		else
+		{
+			auto itCompressed = m_compressed.find(key);
+			
+			if (itCompressed == m_compressed.end())
+				return false;
+			
+			validFrom = itCompressed->second.validFrom;
+			validTo = itCompressed->second.validTo;
+		}
+		
+		if (blockOffset < validFrom || blockOffset + thistime > validTo)
+			return false;
+		
+		pos += thistime;
+	}
+	
+	return true;
+}
+
+size_t CacheZone::getRange(TagId tag, uint64_t offset, size_t count, uint8_t* data, std::vector<Range>& missing)
+{
+	const uint64_t end = offset + count;
+	size_t copied = 0;
+	
+	for (uint64_t pos = offset; pos < end; )
+	{
+		const uint64_t blockId = pos / m_blockSize;
+		const size_t blockOffset = pos & (m_blockSize - 1);
+		const size_t thistime = std::min<uint64_t>(m_blockSize - blockOffset, end - pos);
+		auto it = findBlock(CacheKey{ blockId, tag });
+		
+		m_queries++;
+		
+		// Blocks holding only part of what's asked count as missing
+		if (it != m_cache.end() && blockOffset >= it->second.validFrom && blockOffset + thistime <= it->second.validTo)
+		{
+			memcpy(data + (pos - offset), &it->second.data[blockOffset], thistime);
+			m_cacheAge.splice(m_cacheAge.end(), m_cacheAge, it->second.itAge);
+			m_hits++;
+			copied += thistime;
+		}
+		else if (!missing.empty() && missing.back().offset + missing.back().length == pos)
+			missing.back().length += thistime;
+		else
+			missing.push_back(Range{ pos, thistime });
+		
+		pos += thistime;
+	}
+	
+	evictCache();
+	
+	return copied;
+}
+
+std::vector<uint8_t> CacheZone::acquireBuffer(size_t size)
+{
+	std::vector<uint8_t> buffer;
+	
+	if (!m_idleBuffers.empty())
+	{
+		buffer = std::move(m_idleBuffers.back());
+		m_idleBuffers.pop_back();
+	}
+	
+	buffer.resize(size);
+	return buffer;
+}
+
+void CacheZone::releaseBuffer(std::vector<uint8_t>&& buffer)
+{
+	if (m_idleBuffers.size() < MAX_IDLE_BUFFERS && buffer.capacity() <= MAX_IDLE_BUFFER_SIZE)
+		m_idleBuffers.push_back(std::move(buffer));
+}
+
+void CacheZone::invalidate(TagId tag)
+{
+	auto it = m_tags.find(tag);
+	
+	if (it == m_tags.end())
+		return;
+	
+	while (!it->second.blocks.empty())
+		erase(tag, it->second.blocks.front());
+	
+	forgetTagIfUnused(tag);
+}
+
+void CacheZone::erase(TagId tag, uint64_t blockId)
+{
+	const CacheKey key = CacheKey{ blockId, tag };
+	auto it = m_cache.find(key);
+	
+	if (it != m_cache.end())
+	{
+		m_tags[tag].blocks.erase(it->second.itTagBlocks);
+		m_cacheAge.erase(it->second.itAge);
+		m_cache.erase(it);
+		return;
+	}
+	
+	auto itCompressed = m_compressed.find(key);
+	
+	if (itCompressed != m_compressed.end())
+	{
+		m_tags[tag].blocks.erase(itCompressed->second.itTagBlocks);
+		m_compressedAge.erase(itCompressed->second.itAge);
+		m_compressedBytes -= itCompressed->second.data.size();
+		m_compressed.erase(itCompressed);
+	}
+}
+
 void CacheZone::evictCache()
 {
 	while (m_cache.size() > m_maxBlocks)
 	{
-		CacheKey& key = m_cacheAge.front();
-		m_cache.erase(key);
-		m_cacheAge.erase(m_cacheAge.begin());
+		const CacheKey key = m_cacheAge.front();
+		
+		if (m_compressedLimit > 0 && compressBlock(m_cache.find(key)))
+			continue;
+		
+		erase(key.tag, key.blockId);
+		forgetTagIfUnused(key.tag);
 	}
+	
+	while (m_compressedBytes > m_compressedLimit)
+	{
+		const CacheKey key = m_compressedAge.front();
+		
+		erase(key.tag, key.blockId);
+		forgetTagIfUnused(key.tag);
+	}
+}
+
+CacheZone::Cache::iterator CacheZone::findBlock(const CacheKey& key)
+{
+	auto it = m_cache.find(key);
+	
+	if (it == m_cache.end() && !m_compressed.empty())
+	{
+		auto itCompressed = m_compressed.find(key);
+		
+		if (itCompressed != m_compressed.end())
+			it = decompressBlock(itCompressed);
+	}
+	
+	return it;
+}
+
+bool CacheZone::compressBlock(Cache::iterator it)
+{
+	CacheEntry& entry = it->second;
+	const size_t length = entry.validTo - entry.validFrom;
+	size_t compressed;
+	
+	// Blocks that don't shrink by at least an eighth aren't worth a decompression later
+	m_compressBuffer.resize(length - length / 8);
+	compressed = lz4_compress(&entry.data[entry.validFrom], length, m_compressBuffer.data(), m_compressBuffer.size());
+	
+	if (compressed == 0)
+		return false;
+	
+	CompressedEntry& target = m_compressed[it->first];
+	
+	target.itTagBlocks = entry.itTagBlocks;
+	target.validFrom = entry.validFrom;
+	target.validTo = entry.validTo;
+	target.data.assign(m_compressBuffer.begin(), m_compressBuffer.begin() + compressed);
+	
+	m_compressedAge.push_back(it->first);
+	target.itAge = --m_compressedAge.end();
+	m_compressedBytes += compressed;
+	
+	m_cacheAge.erase(entry.itAge);
+	m_cache.erase(it);
+	
+	return true;
+}
+
+CacheZone::Cache::iterator CacheZone::decompressBlock(CompressedCache::iterator it)
+{
+	const CacheKey key = it->first;
+	CompressedEntry& source = it->second;
+	const size_t length = source.validTo - source.validFrom;
+	std::unique_ptr<uint8_t[]> data(new uint8_t[m_blockSize]);
+	
+	if (lz4_decode(source.data.data(), source.data.size(), &data[source.validFrom], length) != int64_t(length))
+		throw std::logic_error("CacheZone: compressed block is corrupted");
+	
+	Cache::iterator itBlock = m_cache.insert({ key, CacheEntry() }).first;
+	CacheEntry& entry = itBlock->second;
+	
+	entry.itTagBlocks = source.itTagBlocks;
+	entry.validFrom = source.validFrom;
+	entry.validTo = source.validTo;
+	entry.data = std::move(data);
+	
+	m_cacheAge.push_back(key);
+	entry.itAge = --m_cacheAge.end();
+	
+	m_compressedBytes -= source.data.size();
+	m_compressedAge.erase(source.itAge);
+	m_compressed.erase(it);
+	
+	return itBlock;
 }
@@ -6,50 +6,134 @@
 #include <string>
 #include <vector>
 #include <list>
-#include <array>
+#include <memory>
 #include <unordered_map>
 
-namespace std {
-template <typename A, typename B> struct hash<std::pair<A, B>>
-{
-	size_t operator()(const std::pair<A, B>& t) const
-	{
-		return std::hash<A>()(t.first) ^ std::hash<B>()(t.second);
-	}
-};
-}
-
 class CacheZone
 {
 public:
-	CacheZone(size_t maxBlocks);
+	// blockSize must be a power of two
+	CacheZone(size_t maxBlocks, size_t blockSize = BLOCK_SIZE);
 	
+	// Default block size, also the unit of reads where there's no better one
 	enum { BLOCK_SIZE = 4096 };
 	
-	void store(const std::string& vfile, uint64_t blockId, const uint8_t* data, size_t bytes);
-	size_t get(const std::string& vfile, uint64_t blockId, uint8_t* data, size_t offset, size_t maxBytes);
+	// Small integer standing for a cache tag (a file path, "part-N", ...)
+	typedef uint32_t TagId;
+	
+	// Returns the ID for the tag, the same one as long as it is in use or has blocks cached.
+	// Every acquireTag() must be paired with a releaseTag().
+	TagId acquireTag(const std::string& tag);
+	void releaseTag(TagId tag);
+	
+	// Blocks may be filled in pieces, pieces touching the data already held are merged
+	void store(TagId tag, uint64_t blockId, const uint8_t* data, size_t offset, size_t bytes);
+	size_t get(TagId tag, uint64_t blockId, uint8_t* data, size_t offset, size_t maxBytes);
+	// Checks for bytes [offset, offset+count) of the tag without counting as a query or refreshing their age
+	bool contains(TagId tag, uint64_t offset, uint64_t count) const;
+	
+	struct Range
+	{
+		uint64_t offset, length;
+	};
+	
+	// Copies the cached parts of bytes [offset, offset+count) of the tag into data in one pass.
+	// The parts not cached are appended to missing, adjacent blocks merged into a single range.
+	// Returns the number of bytes copied.
+	size_t getRange(TagId tag, uint64_t offset, size_t count, uint8_t* data, std::vector<Range>& missing);
+	
+	// Buffers for data on its way into the cache, handed out again after release
+	std::vector<uint8_t> acquireBuffer(size_t size);
+	void releaseBuffer(std::vector<uint8_t>&& buffer);
+	// Drops all blocks cached for the tag
+	void invalidate(TagId tag);
 	
 	void setMaxBlocks(size_t max);
 	inline size_t maxBlocks() const { return m_maxBlocks; }
 	
+	// Changing the block size empties the zone
+	void setBlockSize(size_t blockSize);
+	inline size_t blockSize() const { return m_blockSize; }
+	
+	// Second tier keeping blocks evicted from the zone LZ4 compressed, within the given number of bytes.
+	// Getting a block back from there costs one block decompression instead of rereading its source. 0 turns it off.
+	void setCompressedLimit(size_t bytes);
+	inline size_t compressedLimit() const { return m_compressedLimit; }
+	
 	inline float hitRate() const { return float(m_hits) / float(m_queries); }
 	inline size_t size() const { return m_cache.size(); }
+	inline size_t compressedSize() const { return m_compressed.size(); }
+	inline size_t compressedBytes() const { return m_compressedBytes; }
 private:
 	void evictCache();
+	void erase(TagId tag, uint64_t blockId);
+	void forgetTagIfUnused(TagId tag);
 private:
-	typedef std::pair<uint64_t, std::string> CacheKey;
+	struct CacheKey
+	{
+		uint64_t blockId;
+		TagId tag;
+		
+		bool operator==(const CacheKey& that) const { return blockId == that.blockId && tag == that.tag; }
+	};
+	
+	struct CacheKeyHash
+	{
+		// splitmix64 finalizer, consecutive blocks of a file spread over the whole table
+		size_t operator()(const CacheKey& key) const
+		{
+			uint64_t x = key.blockId ^ (uint64_t(key.tag) << 40) ^ (uint64_t(key.tag) >> 24);
+			x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+			x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+			return x ^ (x >> 31);
+		}
+	};
 	
 	struct CacheEntry
 	{
 		std::list<CacheKey>::iterator itAge;
-		std::array<uint8_t, BLOCK_SIZE> data;
+		std::list<uint64_t>::iterator itTagBlocks;
+		// part of the block holding data
+		uint32_t validFrom, validTo;
+		std::unique_ptr<uint8_t[]> data;
 	};
 	
-	typedef std::unordered_map<CacheKey, CacheEntry> Cache;
+	struct TagInfo
+	{
+		std::string name;
+		unsigned int users;
+		std::list<uint64_t> blocks; // block IDs cached for this tag, in either tier
+	};
+	
+	struct CompressedEntry
+	{
+		std::list<CacheKey>::iterator itAge;
+		std::list<uint64_t>::iterator itTagBlocks;
+		uint32_t validFrom, validTo;
+		std::vector<uint8_t> data;
+	};
+	
+	typedef std::unordered_map<CacheKey, CacheEntry, CacheKeyHash> Cache;
+	typedef std::unordered_map<CacheKey, CompressedEntry, CacheKeyHash> CompressedCache;
+	
+	// Looks in both tiers, a block found compressed moves back uncompressed
+	Cache::iterator findBlock(const CacheKey& key);
+	bool compressBlock(Cache::iterator it);
+	Cache::iterator decompressBlock(CompressedCache::iterator it);
 	
 	Cache m_cache;
 	std::list<CacheKey> m_cacheAge;
-	size_t m_maxBlocks;
+	// A block is either in m_cache or in m_compressed, never both
+	CompressedCache m_compressed;
+	std::list<CacheKey> m_compressedAge;
+	size_t m_compressedLimit = 0, m_compressedBytes = 0;
+	std::vector<uint8_t> m_compressBuffer;
+	std::unordered_map<std::string, TagId> m_tagIds;
+	std::unordered_map<TagId, TagInfo> m_tags;
+	TagId m_nextTag = 0;
+	std::vector<std::vector<uint8_t>> m_idleBuffers;
+	enum { MAX_IDLE_BUFFERS = 4, MAX_IDLE_BUFFER_SIZE = 16*1024*1024 };
+	size_t m_maxBlocks, m_blockSize;
 	uint64_t m_queries = 0, m_hits = 0;
 };
 
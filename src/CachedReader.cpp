@@ -3,20 +3,25 @@
 #include <algorithm>
 #include <iostream>
 #include <limits>
+#include <vector>
 #include "exceptions.h"
 
 //#define NO_CACHE
 
 CachedReader::CachedReader(std::shared_ptr<Reader> reader, CacheZone* zone, const std::string& tag)
-: m_reader(reader), m_zone(zone), m_tag(tag)
+: m_reader(reader), m_zone(zone), m_tag(zone->acquireTag(tag))
 {
 }
 
+CachedReader::~CachedReader()
+{
+	m_zone->releaseTag(m_tag);
+}
+
 int32_t CachedReader::read(void* buf, int32_t count, uint64_t offset)
 {
 #ifndef NO_CACHE
-	int32_t done = 0; // from 0 till count
-	int32_t lastFetchPos = 0; // pos from 0 till count
+	std::vector<CacheZone::Range> missing;
 	
 #ifdef DEBUG
 	std::cout << "CachedReader::read(): offset=" << offset << ", count=" << count << std::endl;
@@ -24,59 +29,21 @@ int32_t CachedReader::read(void* buf, int32_t count, uint64_t offset)
 
 	if (count+offset > length())
 		count = length() - offset;
+	if (count <= 0)
+		return 0;
 	
-	while (done < count)
-	{
-		int32_t thistime = std::min<int32_t>(count - done, CacheZone::BLOCK_SIZE);
-		uint64_t blockNumber = (offset+done) / CacheZone::BLOCK_SIZE;
-		uint64_t blockOffset = 0;
-		size_t fromCache;
-		
-		if (done == 0) // this may also happen when cache doesn't contain a full block, but not on a R/O filesystem
-			blockOffset = offset % CacheZone::BLOCK_SIZE;
-		
-		thistime = std::min<int32_t>(thistime, CacheZone::BLOCK_SIZE - blockOffset);
-		if (thistime == 0)
-			throw std::logic_error("Internal error: thistime == 0");
-		
-		fromCache = m_zone->get(m_tag, blockNumber, ((uint8_t*) buf) + done, blockOffset, thistime);
-		
-		// Something was retrieved from cache
-		if (fromCache > 0)
-		{
-			// Fetch all previous data from lastFetchPos till (offset+done) from backing store
-			const int32_t toRead = done - lastFetchPos;
-			const uint64_t pos = offset + lastFetchPos;
-			
-			if (toRead > 0)
-			{
-				// Perform non-cached read, while saving everything read into the cache
-				nonCachedRead(((char*) buf) + lastFetchPos, toRead, pos);
-			}
-			
-			// We move lastFetchPos past the current cached read
-			lastFetchPos = done+thistime;
-			
-			done += fromCache;
-		}
-		else
-		{
-			// We pretend that the data was read, we'll read it later via nonCachedRead()
-			//lastFetchPos += thistime;
-			done += thistime;
-		}
-	}
+	// Take what the cache has in one go, then fetch the gaps from backing store
+	m_zone->getRange(m_tag, offset, count, static_cast<uint8_t*>(buf), missing);
 	
-	if (lastFetchPos < count)
+	for (const CacheZone::Range& range : missing)
 	{
-		// Uncached blocks at the end of the requested range
-		const int32_t toRead = done - lastFetchPos;
-		const uint64_t pos = offset + lastFetchPos;
-		
-		nonCachedRead(((char*) buf) + lastFetchPos, toRead, pos);
+		// Perform non-cached read, while saving everything read into the cache
+		nonCachedRead(((char*) buf) + (range.offset - offset), range.length, range.offset);
 	}
 	
-	return done;
+	readAhead(offset, count);
+	
+	return count;
 #else
 	return m_reader->read(buf, count, offset);
 #endif
@@ -84,9 +51,8 @@ int32_t CachedReader::read(void* buf, int32_t count, uint64_t offset)
 
 void CachedReader::nonCachedRead(void* buf, int32_t count, uint64_t offset)
 {
-	uint64_t blockStart, blockEnd;
-	std::unique_ptr<uint8_t[]> optimalBlockBuffer;
-	uint32_t optimalBlockBufferSize = 0;
+	std::vector<ReadRequest> fetches;
+	std::vector<std::vector<uint8_t>> buffers;
 	uint64_t readPos = offset;
 
 #ifdef DEBUG
@@ -95,63 +61,214 @@ void CachedReader::nonCachedRead(void* buf, int32_t count, uint64_t offset)
 
 	while (readPos < offset+count)
 	{
-		int32_t thistime, rd;
-
-		m_reader->adviseOptimalBlock(readPos, blockStart, blockEnd);
+		uint64_t batchBytes = 0;
+		
+		fetches.clear();
+		for (std::vector<uint8_t>& buffer : buffers)
+			m_zone->releaseBuffer(std::move(buffer));
+		buffers.clear();
+		
+		// Collect the optimal blocks covering the range and fetch them together
+		while (readPos < offset+count && batchBytes < MAX_BATCH_BYTES)
+		{
+			uint64_t blockStart, blockEnd;
+			uint8_t* target;
+			
+			m_reader->adviseOptimalBlock(readPos, blockStart, blockEnd);
 
-		// Does the returned block contain what we asked for?
-		if (blockStart > readPos || blockEnd <= readPos)
-			throw std::logic_error("Illegal range returned by adviseOptimalBlock()");
-		if (blockEnd - blockStart > std::numeric_limits<int32_t>::max())
-			throw std::logic_error("Range returned by adviseOptimalBlock() is too large");
+			// Does the returned block contain what we asked for?
+			if (blockStart > readPos || blockEnd <= readPos)
+				throw std::logic_error("Illegal range returned by adviseOptimalBlock()");
+			if (blockEnd - blockStart > std::numeric_limits<int32_t>::max())
+				throw std::logic_error("Range returned by adviseOptimalBlock() is too large");
 
-		thistime = blockEnd-blockStart;
-		if (thistime > optimalBlockBufferSize)
-		{
-			optimalBlockBufferSize = thistime;
-			optimalBlockBuffer.reset(new uint8_t[optimalBlockBufferSize]);
-		}
+			// Blocks lying within the output are read right into it
+			if (blockStart >= offset && blockEnd <= offset+count)
+				target = reinterpret_cast<uint8_t*>(buf) + (blockStart - offset);
+			else
+			{
+				buffers.push_back(m_zone->acquireBuffer(blockEnd - blockStart));
+				target = buffers.back().data();
+			}
 
 #ifdef DEBUG
-		std::cout << "Reading from backing reader: offset=" << blockStart << ", count=" << thistime << std::endl;
+			std::cout << "Reading from backing reader: offset=" << blockStart << ", count=" << blockEnd-blockStart << std::endl;
 #endif
-		rd = m_reader->read(optimalBlockBuffer.get(), thistime, blockStart);
-
-		if (rd < thistime)
-			throw io_error("Short read from backing reader");
-
-		// Align to the next BLOCK_SIZE aligned block
-		uint64_t cachePos = (blockStart + (CacheZone::BLOCK_SIZE-1)) & ~uint64_t(CacheZone::BLOCK_SIZE-1);
-
-		// And start storing everything we've just read into cache
-		while (cachePos < blockEnd)
+			fetches.push_back(ReadRequest{ target, int32_t(blockEnd - blockStart), blockStart, 0 });
+			batchBytes += blockEnd - blockStart;
+			readPos = blockEnd;
+		}
+		
+		m_reader->readBatch(fetches.data(), fetches.size());
+		
+		for (const ReadRequest& fetch : fetches)
 		{
-			m_zone->store(m_tag, cachePos / CacheZone::BLOCK_SIZE, &optimalBlockBuffer[cachePos - blockStart],
-					std::min<size_t>(blockEnd-cachePos, CacheZone::BLOCK_SIZE));
-			cachePos += CacheZone::BLOCK_SIZE;
+			const uint8_t* data = static_cast<const uint8_t*>(fetch.buf);
+			
+			if (fetch.result < fetch.count)
+				throw io_error("Short read from backing reader");
+			
+			storeInCache(data, fetch.offset, fetch.offset + fetch.count);
+			
+			// Copy the part we were asked for into the output buffer, unless it was read there
+			const uint64_t copyStart = std::max<uint64_t>(fetch.offset, offset);
+			const uint64_t copyEnd = std::min<uint64_t>(fetch.offset + fetch.count, offset+count);
+			
+			if (data + (copyStart - fetch.offset) != reinterpret_cast<uint8_t*>(buf) + (copyStart - offset))
+				std::copy_n(data + (copyStart - fetch.offset), copyEnd - copyStart, reinterpret_cast<uint8_t*>(buf) + (copyStart - offset));
 		}
+	}
+	
+	for (std::vector<uint8_t>& buffer : buffers)
+		m_zone->releaseBuffer(std::move(buffer));
+}
 
-		// Copy into output buffer
-		uint32_t optimalOffset = 0; // offset into optimalBlockBuffer to start copying from
-		uint32_t outputOffset; // offset into 'buf' to copy to
-		uint32_t toCopy;
+void CachedReader::storeInCache(const uint8_t* data, uint64_t blockStart, uint64_t blockEnd)
+{
+	const size_t cacheBlockSize = m_zone->blockSize();
+	uint64_t cachePos = blockStart;
 
-		if (readPos > blockStart)
-			optimalOffset = readPos - blockStart;
-		outputOffset = readPos - offset;
-		toCopy = std::min<uint32_t>(offset+count - readPos, thistime - optimalOffset);
+	// Store everything we've just read into cache, the first and last cache block possibly in part
+	while (cachePos < blockEnd)
+	{
+		const size_t offsetInBlock = cachePos & (cacheBlockSize - 1);
+		const size_t thistime = std::min<uint64_t>(cacheBlockSize - offsetInBlock, blockEnd - cachePos);
+		
+		m_zone->store(m_tag, cachePos / cacheBlockSize, &data[cachePos - blockStart], offsetInBlock, thistime);
+		cachePos += thistime;
+	}
+}
 
+bool CachedReader::isCached(uint64_t start, uint64_t end) const
+{
+	return m_zone->contains(m_tag, start, end - start);
+}
+
+void CachedReader::readAhead(uint64_t offset, int32_t count)
+{
+	// A stream continues where the previous read ended
+	const bool sequential = offset == m_nextOffset;
+	const uint64_t end = offset + count;
+	
+	m_nextOffset = end;
+	
+	if (!sequential)
+	{
+		// Random access, don't fill the cache with data nobody asks for
+		m_readAheadWindow = 0;
+		m_readAheadEnd = 0;
+		return;
+	}
+	
+	if (!m_readAheadEnabled)
+		return;
+	
+	m_readAheadWindow = m_readAheadWindow ? std::min<uint32_t>(m_readAheadWindow * 2, MAX_READAHEAD) : uint32_t(MIN_READAHEAD);
+	
+	// Fetch the next window once the reader is halfway through the data read ahead so far,
+	// so that the stream keeps being served from the cache
+	if (end + m_readAheadWindow / 2 < m_readAheadEnd)
+		return;
+	
+	const uint64_t start = std::max(end, m_readAheadEnd);
+	const uint64_t stop = std::min(end + m_readAheadWindow, length());
+	
+	if (start >= stop)
+		return;
+	
+	try
+	{
+		FetchList list;
+		
+		queueMissingBlocks(start, stop, list);
+		fetchQueuedBlocks(list);
+		
+		m_readAheadEnd = stop;
+	}
+	catch (const std::exception& e)
+	{
+		// Nobody asked for that data yet, its errors are for whoever reads it later
 #ifdef DEBUG
-		std::cout << "Copying " << toCopy << " bytes into output buffer at offset " << outputOffset << " from internal offset " << optimalOffset << std::endl;
+		std::cerr << "CachedReader::readAhead(): " << e.what() << std::endl;
 #endif
-		// if (toCopy+optimalOffset > thistime)
-		// 	throw std::logic_error("Internal error");
-		std::copy_n(&optimalBlockBuffer[optimalOffset], toCopy, reinterpret_cast<uint8_t*>(buf) + outputOffset);
+		m_readAheadWindow = 0;
+		m_readAheadEnd = 0;
+	}
+}
 
-		readPos += toCopy;
+void CachedReader::queueMissingBlocks(uint64_t start, uint64_t end, FetchList& list)
+{
+	uint64_t pos = start;
+	
+	while (pos < end && list.bytes < MAX_BATCH_BYTES)
+	{
+		uint64_t blockStart, blockEnd;
+		
+		m_reader->adviseOptimalBlock(pos, blockStart, blockEnd);
+		if (blockStart > pos || blockEnd <= pos)
+			throw std::logic_error("Illegal range returned by adviseOptimalBlock()");
+		if (blockEnd - blockStart > std::numeric_limits<int32_t>::max())
+			throw std::logic_error("Range returned by adviseOptimalBlock() is too large");
+		
+		// Only the part we are asked for matters
+		if (!isCached(pos, std::min(blockEnd, end)) && list.queued.insert(blockStart).second)
+		{
+			list.buffers.push_back(m_zone->acquireBuffer(blockEnd - blockStart));
+			list.fetches.push_back(ReadRequest{ list.buffers.back().data(), int32_t(blockEnd - blockStart), blockStart, 0 });
+			list.bytes += blockEnd - blockStart;
+		}
+		
+		pos = blockEnd;
 	}
 }
 
+void CachedReader::fetchQueuedBlocks(FetchList& list)
+{
+	if (!list.fetches.empty())
+	{
+		m_reader->readBatch(list.fetches.data(), list.fetches.size());
+		
+		for (const ReadRequest& fetch : list.fetches)
+		{
+			if (fetch.result == fetch.count)
+				storeInCache(static_cast<uint8_t*>(fetch.buf), fetch.offset, fetch.offset + fetch.count);
+		}
+	}
+	
+	for (std::vector<uint8_t>& buffer : list.buffers)
+		m_zone->releaseBuffer(std::move(buffer));
+	
+	list.fetches.clear();
+	list.buffers.clear();
+}
+
+void CachedReader::readBatch(ReadRequest* requests, size_t count)
+{
+#ifndef NO_CACHE
+	FetchList list;
+	const uint64_t len = length();
+	
+	// A single request gains nothing over read()
+	if (count < 2)
+	{
+		Reader::readBatch(requests, count);
+		return;
+	}
+	
+	// Collect the backing blocks missing from the cache...
+	for (size_t i = 0; i < count && list.bytes < MAX_BATCH_BYTES; i++)
+		queueMissingBlocks(requests[i].offset, std::min<uint64_t>(len, requests[i].offset + requests[i].count), list);
+	
+	// ...and have the backing reader fetch them all at once
+	if (list.fetches.size() < 2)
+		list.fetches.clear();
+	fetchQueuedBlocks(list);
+#endif
+	
+	// Now served from the cache, except for what didn't fit into it
+	Reader::readBatch(requests, count);
+}
+
 uint64_t CachedReader::length()
 {
 	return m_reader->length();
@@ -3,20 +3,58 @@
 #include "Reader.h"
 #include "CacheZone.h"
 #include <memory>
+#include <set>
+#include <vector>
 
 class CachedReader : public Reader
 {
 public:
+	// zone must outlive the reader
 	CachedReader(std::shared_ptr<Reader> reader, CacheZone* zone, const std::string& tag);
+	~CachedReader();
 	
 	virtual int32_t read(void* buf, int32_t count, uint64_t offset) override;
 	virtual uint64_t length() override;
+	virtual void readBatch(ReadRequest* requests, size_t count) override;
+	virtual bool isCaching() override { return true; }
+	
+	// Readahead of sequential streams is on by default, readers filling the cache on purpose turn it off
+	inline void setReadAhead(bool enabled) { m_readAheadEnabled = enabled; }
 private:
 	void nonCachedRead(void* buf, int32_t count, uint64_t offset);
+	void storeInCache(const uint8_t* data, uint64_t blockStart, uint64_t blockEnd);
+	bool isCached(uint64_t start, uint64_t end) const;
+	
+	// Backing blocks about to be fetched together
+	struct FetchList
+	{
+		std::vector<ReadRequest> fetches;
+		std::vector<std::vector<uint8_t>> buffers;
+		std::set<uint64_t> queued;
+		uint64_t bytes = 0;
+	};
+	
+	// Queues the backing blocks holding [start, end) that the cache lacks
+	void queueMissingBlocks(uint64_t start, uint64_t end, FetchList& list);
+	// Reads the queued blocks in one batch into the cache
+	void fetchQueuedBlocks(FetchList& list);
+	
+	// Tracks the access pattern after a read, and reads ahead of sequential streams
+	void readAhead(uint64_t offset, int32_t count);
+	
+	// Upper bound for the data fetched by a single readBatch()
+	enum { MAX_BATCH_BYTES = 16*1024*1024 };
+	// The readahead window starts small and doubles with every sequential read, up to the maximum
+	enum { MIN_READAHEAD = 128*1024, MAX_READAHEAD = 2*1024*1024 };
 private:
 	std::shared_ptr<Reader> m_reader;
 	CacheZone* m_zone;
-	const std::string m_tag;
+	const CacheZone::TagId m_tag;
+	
+	// Where a sequential reader continues, how far data has been read ahead and how far to go next time (0 = random access)
+	uint64_t m_nextOffset = UINT64_MAX, m_readAheadEnd = 0;
+	uint32_t m_readAheadWindow = 0;
+	bool m_readAheadEnabled = true;
 };
 
 #endif
@@ -5,11 +5,16 @@
 	#include <lzfse.h>
 #endif
 #include "adc.h"
+#include "InflateBackend.h"
+#include "ThreadPool.h"
 #include <cstring>
 #include <memory>
 #include <algorithm>
 #include <stdexcept>
 #include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
 #include <iostream>
 #include "exceptions.h"
 #include <cassert>
@@ -20,9 +25,13 @@ public:
 	DMGDecompressor_Zlib(std::shared_ptr<Reader> reader);
 	~DMGDecompressor_Zlib();
 	virtual int32_t decompress(void* output, int32_t count, int64_t offset) override;
+	virtual int32_t decompressRun(void* output, int32_t runLength) override;
+protected:
+	virtual void reset() override;
 private:
 	virtual int32_t decompress(void* output, int32_t count);
 	z_stream m_strm;
+	std::vector<uint8_t> m_input;
 };
 
 class DMGDecompressor_Bzip2 : public DMGDecompressor
@@ -31,9 +40,14 @@ public:
 	DMGDecompressor_Bzip2(std::shared_ptr<Reader> reader);
 	~DMGDecompressor_Bzip2();
 	virtual int32_t decompress(void* output, int32_t count, int64_t offset) override;
+	virtual int32_t decompressRun(void* output, int32_t runLength) override;
+protected:
+	virtual void reset() override;
 private:
 	virtual int32_t decompress(void* output, int32_t count);
+	bool decompressBlocksParallel(const uint8_t* in, size_t inLength, void* output, int32_t runLength);
 	bz_stream m_strm;
+	std::vector<uint8_t> m_input;
 };
 
 class DMGDecompressor_ADC : public DMGDecompressor
@@ -41,15 +55,60 @@ class DMGDecompressor_ADC : public DMGDecompressor
 public:
 	DMGDecompressor_ADC(std::shared_ptr<Reader> reader) : DMGDecompressor(reader) {}
 	virtual int32_t decompress(void* output, int32_t count, int64_t offset) override;
+	virtual int32_t decompressRun(void* output, int32_t runLength) override;
+	virtual void setRunState(std::shared_ptr<RunState>& state, uint64_t runLength) override;
+protected:
+	virtual void reset() override;
+private:
+	enum
+	{
+		MAX_LOOKBACK = 0x10000,
+		MAX_PHRASE = 0x80,
+		// Output distance between restart points
+		CHECKPOINT_INTERVAL = 256*1024
+	};
+	
+	// Decoder position along with the lookback window preceding it
+	struct Checkpoint
+	{
+		uint32_t inPos;
+		uint64_t outPos;
+		std::vector<uint8_t> window;
+	};
+	
+	struct Checkpoints : public RunState
+	{
+		// indexed by outPos / CHECKPOINT_INTERVAL
+		std::map<uint64_t, Checkpoint> points;
+	};
+	
+	std::shared_ptr<Checkpoints> m_checkpoints;
+	std::vector<uint8_t> m_input;
+	std::vector<uint8_t> m_scratch;
 };
 
 class DMGDecompressor_LZFSE : public DMGDecompressor
 {
 public:
-	DMGDecompressor_LZFSE(std::shared_ptr<Reader> reader) : DMGDecompressor(reader) {}
+	DMGDecompressor_LZFSE(std::shared_ptr<Reader> reader) : DMGDecompressor(reader), m_runLength(0) {}
 	virtual int32_t decompress(void* output, int32_t count, int64_t offset) override;
+	virtual int32_t decompressRun(void* output, int32_t runLength) override;
+	virtual void setRunState(std::shared_ptr<RunState>& state, uint64_t runLength) override;
+protected:
+	virtual void reset() override;
 private:
-	virtual int32_t decompress(void* output, int32_t outputBytes);
+	int32_t decode(void* output, int32_t outputBytes);
+	
+	struct DecodedRun : public RunState
+	{
+		std::vector<uint8_t> data;
+	};
+	
+	std::shared_ptr<DecodedRun> m_decodedRun;
+	uint64_t m_runLength;
+	std::vector<uint8_t> m_input;
+	// Decoder scratch space, kept along with the pooled decompressor
+	std::unique_ptr<uint8_t[]> m_scratch;
 };
 
 DMGDecompressor::DMGDecompressor(std::shared_ptr<Reader> reader)
@@ -59,21 +118,114 @@ DMGDecompressor::DMGDecompressor(std::shared_ptr<Reader> reader)
 
 DMGDecompressor* DMGDecompressor::create(RunType runType, std::shared_ptr<Reader> reader)
 {
+	DMGDecompressor* decompressor;
+	
 	switch (runType)
 	{
 		case RunType::Zlib:
-			return new DMGDecompressor_Zlib(reader);
+			decompressor = new DMGDecompressor_Zlib(reader);
+			break;
 		case RunType::Bzip2:
-			return new DMGDecompressor_Bzip2(reader);
+			decompressor = new DMGDecompressor_Bzip2(reader);
+			break;
 		case RunType::ADC:
-			return new DMGDecompressor_ADC(reader);
+			decompressor = new DMGDecompressor_ADC(reader);
+			break;
 #ifdef COMPILE_WITH_LZFSE
 		case RunType::LZFSE:
-			return new DMGDecompressor_LZFSE(reader);
+			decompressor = new DMGDecompressor_LZFSE(reader);
+			break;
 #endif
 		default:
 			return nullptr;
 	}
+	
+	decompressor->m_runType = runType;
+	return decompressor;
+}
+
+namespace
+{
+	struct DecompressorPool
+	{
+		std::mutex mutex;
+		std::map<RunType, std::vector<DMGDecompressor*>> idle;
+		
+		~DecompressorPool()
+		{
+			for (auto& entry : idle)
+			{
+				for (DMGDecompressor* decompressor : entry.second)
+					delete decompressor;
+			}
+		}
+	};
+	
+	DecompressorPool& decompressorPool()
+	{
+		static DecompressorPool pool;
+		return pool;
+	}
+}
+
+DMGDecompressor::Handle DMGDecompressor::acquire(RunType runType, std::shared_ptr<Reader> reader)
+{
+	DecompressorPool& pool = decompressorPool();
+	DMGDecompressor* decompressor = nullptr;
+	
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		std::vector<DMGDecompressor*>& idle = pool.idle[runType];
+		
+		if (!idle.empty())
+		{
+			decompressor = idle.back();
+			idle.pop_back();
+		}
+	}
+	
+	// Idle decompressors were reset when released
+	if (decompressor != nullptr)
+	{
+		decompressor->m_reader = reader;
+		decompressor->m_pos = 0;
+	}
+	else
+		decompressor = create(runType, reader);
+	
+	return Handle(decompressor);
+}
+
+void DMGDecompressor::Release::operator()(DMGDecompressor* decompressor) const
+{
+	DecompressorPool& pool = decompressorPool();
+	
+	// Don't keep the underlying image alive, nor the state of its runs (decoded LZFSE runs, ADC windows)
+	decompressor->m_reader.reset();
+	
+	try
+	{
+		decompressor->reset();
+	}
+	catch (...)
+	{
+		// Called from unique_ptr's destructor, so don't throw
+		delete decompressor;
+		return;
+	}
+	
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		std::vector<DMGDecompressor*>& idle = pool.idle[decompressor->m_runType];
+		
+		if (idle.size() < MAX_IDLE)
+		{
+			idle.push_back(decompressor);
+			return;
+		}
+	}
+	
+	delete decompressor;
 }
 
 int DMGDecompressor::readSome(char** ptr)
@@ -87,6 +239,27 @@ int DMGDecompressor::readSome(char** ptr)
 	return rd;
 }
 
+const uint8_t* DMGDecompressor::readAll(std::vector<uint8_t>& buffer, size_t& length)
+{
+	const uint64_t total = readerLength();
+	const uint8_t* data;
+	
+	if (total > INT32_MAX)
+		throw io_error("Compressed run is too large");
+	
+	length = total;
+	
+	data = m_reader->directData(0, total);
+	if (data != nullptr)
+		return data;
+	
+	buffer.resize(total);
+	if (total > 0 && m_reader->read(buffer.data(), total, 0) != int32_t(total))
+		throw io_error("DMGDecompressor cannot read from stream");
+	
+	return buffer.data();
+}
+
 void DMGDecompressor::processed(int bytes)
 {
 	m_pos += bytes;
@@ -109,6 +282,13 @@ DMGDecompressor_Zlib::~DMGDecompressor_Zlib()
 	inflateEnd(&m_strm);
 }
 
+void DMGDecompressor_Zlib::reset()
+{
+	if (inflateReset(&m_strm) != Z_OK)
+		throw io_error("inflateReset failed");
+	m_strm.avail_in = 0;
+}
+
 int32_t DMGDecompressor_Zlib::decompress(void* output, int32_t count)
 {
 	int status;
@@ -166,6 +346,19 @@ int32_t DMGDecompressor_Zlib::decompress(void* output, int32_t count, int64_t of
 	return bytesDecompressed;
 }
 
+int32_t DMGDecompressor_Zlib::decompressRun(void* output, int32_t runLength)
+{
+	// Both sizes are known, so decode the run in one go instead of streaming it through m_buf
+	size_t inLength;
+	const uint8_t* in = readAll(m_input, inLength);
+	
+	int64_t done = InflateBackend::instance()->inflate(in, inLength, (uint8_t*) output, runLength);
+	if (done < 0)
+		return Z_DATA_ERROR;
+	
+	return done;
+}
+
 DMGDecompressor_Bzip2::DMGDecompressor_Bzip2(std::shared_ptr<Reader> reader)
 	: DMGDecompressor(reader)
 {
@@ -179,6 +372,16 @@ DMGDecompressor_Bzip2::~DMGDecompressor_Bzip2()
 	BZ2_bzDecompressEnd(&m_strm);
 }
 
+void DMGDecompressor_Bzip2::reset()
+{
+	// libbz2 has no way to reset a stream, so this still costs a re-init.
+	// At least the decompressor object and its buffers are reused.
+	BZ2_bzDecompressEnd(&m_strm);
+	memset(&m_strm, 0, sizeof(m_strm));
+	if (BZ2_bzDecompressInit(&m_strm, 0, false) != BZ_OK)
+		throw std::bad_alloc();
+}
+
 int32_t DMGDecompressor_Bzip2::decompress(void* output, int32_t count)
 {
 	int status;
@@ -236,121 +439,381 @@ int32_t DMGDecompressor_Bzip2::decompress(void* output, int32_t count, int64_t o
 	return bytesDecompressed;
 }
 
-int32_t DMGDecompressor_ADC::decompress(void* output, int32_t count, int64_t offset)
+int32_t DMGDecompressor_Bzip2::decompressRun(void* output, int32_t runLength)
 {
-	if (offset < 0)
-		throw io_error("offset < 0");
-
-	int32_t countLeft = count;
-	int nb_read;
-	int32_t nb_input_char_used;
-	char* inputBuffer;
-	int restartIndex = 0;
-	int bytes_written;
-
-	uint8_t decrompressBuffer[0x20000 + 0x80]; // 2x maximum lookback + maximum size of a decompressed chunk
-
-	while ( countLeft > 0 )
+	int status;
+	size_t inLength;
+	const uint8_t* in = readAll(m_input, inLength);
+	
+	if (decompressBlocksParallel(in, inLength, output, runLength))
+		return runLength;
+	
+	// Serial decoding of the whole run in one go
+	m_strm.next_in = (char*) in;
+	m_strm.avail_in = inLength;
+	m_strm.next_out = (char*) output;
+	m_strm.avail_out = runLength;
+	
+	do
 	{
-		nb_read = readSome(&inputBuffer);
-
-		nb_input_char_used = adc_decompress(nb_read, (uint8_t*)inputBuffer, sizeof(decrompressBuffer), (uint8_t* )&decrompressBuffer[0], restartIndex, &bytes_written);
+		status = BZ2_bzDecompress(&m_strm);
+		
+		if (status < 0)
+			return status;
+	}
+	while (status != BZ_STREAM_END && m_strm.avail_out > 0 && m_strm.avail_in > 0);
+	
+	return runLength - m_strm.avail_out;
+}
 
-		if (nb_input_char_used == 0)
-			throw io_error("nb_input_char_used == 0");
+namespace
+{
+	// bzip2 blocks are not byte aligned, they start with a 48-bit magic (BCD pi)
+	// and the stream ends with another 48-bit magic (BCD sqrt(pi)) followed by the stream CRC.
+	const uint64_t BZ2_BLOCK_MAGIC = 0x314159265359ull;
+	const uint64_t BZ2_EOS_MAGIC = 0x177245385090ull;
+	const uint64_t BZ2_MAGIC_MASK = 0xffffffffffffull;
+	
+	class BitWriter
+	{
+	public:
+		void putBits(uint32_t value, int bits)
+		{
+			while (bits > 0)
+			{
+				const int now = std::min(bits, 8);
+				
+				bits -= now;
+				m_acc = (m_acc << now) | ((value >> bits) & ((1u << now) - 1));
+				m_accBits += now;
+				
+				if (m_accBits >= 8)
+				{
+					m_accBits -= 8;
+					m_data.push_back(uint8_t(m_acc >> m_accBits));
+				}
+			}
+		}
 		
-		if ( bytes_written >= offset+countLeft) {
-			memcpy(output, decrompressBuffer+offset, countLeft);
-			countLeft = 0;
+		// Appends bits [startBit, startBit+count) of src
+		void putBitsFrom(const uint8_t* src, uint64_t startBit, uint64_t count)
+		{
+			while (count >= 8)
+			{
+				const uint64_t idx = startBit >> 3;
+				const int shift = startBit & 7;
+				uint8_t byte = src[idx];
+				
+				if (shift)
+					byte = (src[idx] << shift) | (src[idx+1] >> (8 - shift));
+				
+				putBits(byte, 8);
+				startBit += 8;
+				count -= 8;
+			}
+			
+			for (; count > 0; count--, startBit++)
+				putBits((src[startBit >> 3] >> (7 - (startBit & 7))) & 1, 1);
 		}
-		else if ( bytes_written >= 0x20000) {
-			if (offset < 0x10000) {
-				memcpy(output, decrompressBuffer+offset, 0x10000-offset);
-				output = ((uint8_t*)output)+0x10000-offset;
-				offset = 0;
-				countLeft -= 0x10000-offset;
-			}else{
-				// to copy = 0
-				offset -= 0x10000;
+		
+		std::vector<uint8_t>& finish()
+		{
+			if (m_accBits > 0)
+				putBits(0, 8 - m_accBits);
+			return m_data;
+		}
+	private:
+		std::vector<uint8_t> m_data;
+		uint32_t m_acc = 0;
+		int m_accBits = 0;
+	};
+	
+	// Decodes a complete bzip2 stream of unknown decompressed size
+	bool bz2DecodeStream(std::vector<uint8_t>& input, std::vector<uint8_t>& output, size_t sizeHint)
+	{
+		bz_stream strm;
+		int status;
+		
+		memset(&strm, 0, sizeof(strm));
+		if (BZ2_bzDecompressInit(&strm, 0, false) != BZ_OK)
+			return false;
+		
+		output.resize(sizeHint);
+		strm.next_in = (char*) input.data();
+		strm.avail_in = input.size();
+		strm.next_out = (char*) output.data();
+		strm.avail_out = output.size();
+		
+		while ((status = BZ2_bzDecompress(&strm)) == BZ_OK)
+		{
+			if (strm.avail_out == 0)
+			{
+				const size_t done = output.size();
+				
+				output.resize(done * 2);
+				strm.next_out = (char*) &output[done];
+				strm.avail_out = output.size() - done;
 			}
-			memmove(decrompressBuffer, decrompressBuffer+0x10000, bytes_written - 0x10000); // memory can overlap, so memmove in mandatory
-			restartIndex = bytes_written - 0x10000;
-		}else{
-			restartIndex = bytes_written;
+			else if (strm.avail_in == 0)
+				break;
 		}
+		
+		output.resize(output.size() - strm.avail_out);
+		BZ2_bzDecompressEnd(&strm);
+		
+		return status == BZ_STREAM_END;
+	}
+}
 
-		processed(nb_input_char_used);
+// Splits the run into its blocks the way bzip2recover does, wraps each block into a standalone
+// stream and decodes them concurrently. Returns false if the run cannot be handled this way.
+bool DMGDecompressor_Bzip2::decompressBlocksParallel(const uint8_t* in, size_t inLength, void* output, int32_t runLength)
+{
+	std::vector<uint64_t> blockStarts;
+	uint64_t eosStart = 0;
+	uint64_t shift = 0;
+	
+	if (ThreadPool::instance()->concurrency() < 2)
+		return false;
+	
+	// "BZh" followed by the block size digit
+	if (inLength < 4 || in[0] != 'B' || in[1] != 'Z' || in[2] != 'h' || in[3] < '1' || in[3] > '9')
+		return false;
+	
+	for (uint64_t bit = 32; bit < uint64_t(inLength) * 8; bit++)
+	{
+		shift = (shift << 1) | ((in[bit >> 3] >> (7 - (bit & 7))) & 1);
+		
+		if (bit < 32 + 47)
+			continue;
+		
+		if ((shift & BZ2_MAGIC_MASK) == BZ2_BLOCK_MAGIC)
+		{
+			// Another stream or garbage after the end of stream
+			if (eosStart)
+				return false;
+			blockStarts.push_back(bit - 47);
+		}
+		else if ((shift & BZ2_MAGIC_MASK) == BZ2_EOS_MAGIC)
+		{
+			if (eosStart)
+				return false;
+			eosStart = bit - 47;
+		}
 	}
-	return count;
+	
+	if (blockStarts.size() < 2 || blockStarts[0] != 32 || !eosStart || eosStart + 48 + 32 > uint64_t(inLength) * 8)
+		return false;
+	
+	std::vector<std::vector<uint8_t>> decoded(blockStarts.size());
+	const size_t blockSizeHint = (in[3] - '0') * 100000;
+	std::atomic<bool> ok(true);
+	
+	ThreadPool::instance()->parallelFor(blockStarts.size(), [&](size_t i) {
+		const uint64_t start = blockStarts[i];
+		const uint64_t end = (i+1 < blockStarts.size()) ? blockStarts[i+1] : eosStart;
+		BitWriter writer;
+		uint32_t blockCRC = 0;
+		
+		// The block CRC follows the block magic
+		for (uint64_t bit = start + 48; bit < start + 80; bit++)
+			blockCRC = (blockCRC << 1) | ((in[bit >> 3] >> (7 - (bit & 7))) & 1);
+		
+		// A single block stream's combined CRC equals the block CRC
+		writer.putBitsFrom(in, 0, 32);
+		writer.putBitsFrom(in, start, end - start);
+		writer.putBits(uint32_t(BZ2_EOS_MAGIC >> 24), 24);
+		writer.putBits(uint32_t(BZ2_EOS_MAGIC & 0xffffff), 24);
+		writer.putBits(blockCRC, 32);
+		
+		if (!bz2DecodeStream(writer.finish(), decoded[i], blockSizeHint))
+			ok = false;
+	});
+	
+	if (!ok)
+		return false;
+	
+	// Assemble the blocks in order
+	size_t total = 0;
+	for (const std::vector<uint8_t>& block : decoded)
+	{
+		if (total + block.size() > size_t(runLength))
+			return false;
+		
+		memcpy(static_cast<uint8_t*>(output) + total, block.data(), block.size());
+		total += block.size();
+	}
+	
+	return total == size_t(runLength);
 }
 
-#ifdef COMPILE_WITH_LZFSE
+void DMGDecompressor_ADC::reset()
+{
+	m_checkpoints.reset();
+}
 
-int32_t DMGDecompressor_LZFSE::decompress(void* output, int32_t outputBytes)
+void DMGDecompressor_ADC::setRunState(std::shared_ptr<RunState>& state, uint64_t /*runLength*/)
 {
-	// DMGDecompressor can only read by 8k while compressed length of a LZFSE block can be much bigger
+	if (!state)
+		state = std::make_shared<Checkpoints>();
+	m_checkpoints = std::static_pointer_cast<Checkpoints>(state);
+}
 
-	int32_t done = 0;
-	char* input = nullptr;
-	char *inputBig = nullptr;
+int32_t DMGDecompressor_ADC::decompressRun(void* output, int32_t runLength)
+{
+	size_t pos = 0, inLength;
+	const uint8_t* in = readAll(m_input, inLength);
 	
-	int inputBytes = readSome(&input);
-
-	const uint64_t readerTotalSize = readerLength();
+	// No window to maintain, the output itself is the lookback buffer
+	if (adc_decode(in, inLength, (uint8_t*) output, runLength, &pos, runLength) < 0)
+		throw io_error("Invalid ADC data");
+	
+	return pos;
+}
 
-	if (inputBytes < readerTotalSize)
+int32_t DMGDecompressor_ADC::decompress(void* output, int32_t count, int64_t offset)
+{
+	uint64_t base = 0; // output position corresponding to m_scratch[0]
+	uint64_t inPos = 0;
+	size_t pos = 0, stop, inLength;
+	const uint8_t* in;
+	
+	if (offset < 0)
+		throw io_error("offset < 0");
+	
+	in = readAll(m_input, inLength);
+	
+	// Resume from the closest restart point before offset
+	if (m_checkpoints)
 	{
-		inputBig = new char[readerTotalSize];
-		memcpy(inputBig, input, inputBytes);
-
-		processed(inputBytes);
-
-		do
+		auto it = m_checkpoints->points.upper_bound(offset / CHECKPOINT_INTERVAL);
+		
+		while (it != m_checkpoints->points.begin())
 		{
-			int nextReadBytes = readSome(&input);
+			--it;
+			if (it->second.outPos <= uint64_t(offset))
+			{
+				const Checkpoint& cp = it->second;
+				
+				inPos = cp.inPos;
+				base = cp.outPos - cp.window.size();
+				pos = cp.window.size();
+				break;
+			}
+		}
+	}
+	
+	stop = offset + count - base;
+	m_scratch.resize(stop + MAX_PHRASE);
+	
+	if (pos > 0)
+	{
+		const Checkpoint& cp = m_checkpoints->points[(base + pos) / CHECKPOINT_INTERVAL];
+		memcpy(m_scratch.data(), cp.window.data(), pos);
+	}
+	
+	while (pos < stop)
+	{
+		const uint64_t nextCheckpoint = ((base + pos) / CHECKPOINT_INTERVAL + 1) * CHECKPOINT_INTERVAL;
+		const size_t thisStop = std::min<uint64_t>(stop, nextCheckpoint - base);
+		int64_t consumed;
+		
+		consumed = adc_decode(in + inPos, inLength - inPos, m_scratch.data(), m_scratch.size(), &pos, thisStop);
+		if (consumed < 0)
+			throw io_error("Invalid ADC data");
+		
+		inPos += consumed;
+		if (pos < thisStop)
+			break; // end of input
+		
+		const uint64_t outPos = base + pos;
+		
+		if (m_checkpoints && outPos >= nextCheckpoint && !m_checkpoints->points.count(outPos / CHECKPOINT_INTERVAL))
+		{
+			Checkpoint& cp = m_checkpoints->points[outPos / CHECKPOINT_INTERVAL];
+			const size_t windowLength = std::min<size_t>(pos, MAX_LOOKBACK);
 			
-			memcpy(inputBig + inputBytes, input, nextReadBytes);
-
-			inputBytes += nextReadBytes;
-
-			processed(nextReadBytes);
-		} 
-		while (inputBytes < readerTotalSize);
-
-		input = inputBig;
+			cp.inPos = inPos;
+			cp.outPos = outPos;
+			cp.window.assign(m_scratch.data() + pos - windowLength, m_scratch.data() + pos);
+		}
 	}
+	
+	if (base + pos <= uint64_t(offset))
+		return 0;
+	
+	const int32_t done = std::min<uint64_t>(count, base + pos - offset);
+	memcpy(output, m_scratch.data() + (offset - base), done);
+	
+	return done;
+}
+
+#ifdef COMPILE_WITH_LZFSE
 
-	size_t out_size = lzfse_decode_buffer((uint8_t *)output, outputBytes, (const uint8_t *)input, inputBytes, nullptr);
+void DMGDecompressor_LZFSE::reset()
+{
+	m_decodedRun.reset();
+	m_runLength = 0;
+}
 
+int32_t DMGDecompressor_LZFSE::decode(void* output, int32_t outputBytes)
+{
+	if (!m_scratch)
+		m_scratch.reset(new uint8_t[lzfse_decode_scratch_size()]);
+	
+	size_t inLength;
+	const uint8_t* in = readAll(m_input, inLength);
+	
+	const size_t out_size = lzfse_decode_buffer((uint8_t *)output, outputBytes, in, inLength, m_scratch.get());
+	
 	if (out_size == 0)
 		throw io_error("DMGDecompressor_LZFSE failed");
-
-	if (inputBig)
-		delete[] inputBig;
-	else
-		processed(inputBytes);
 	
 	return out_size;
 }
 
+void DMGDecompressor_LZFSE::setRunState(std::shared_ptr<RunState>& state, uint64_t runLength)
+{
+	if (!state)
+		state = std::make_shared<DecodedRun>();
+	m_decodedRun = std::static_pointer_cast<DecodedRun>(state);
+	m_runLength = runLength;
+}
+
+int32_t DMGDecompressor_LZFSE::decompressRun(void* output, int32_t runLength)
+{
+	return decode(output, runLength);
+}
+
 int32_t DMGDecompressor_LZFSE::decompress(void* output, int32_t count, int64_t offset)
 {
-	int32_t done = 0;
+	std::vector<uint8_t> local;
+	std::vector<uint8_t>* data = &local;
 
 #ifdef DEBUG
 	std::cout << "lzfse: Asked to provide " << count << " bytes\n";
 #endif
 
-	while (offset > 0)
+	if (offset < 0)
+		throw io_error("offset < 0");
+	
+	// LZFSE cannot start in the middle of a run, so decode it whole once and serve
+	// all further reads of this run from the result
+	if (m_decodedRun)
+		data = &m_decodedRun->data;
+	
+	if (data->empty())
 	{
-		char waste[4096];
-		int32_t to_read = std::min(int64_t(sizeof(waste)), offset);
-		int32_t bytesDecompressed = decompress(waste, to_read);
-		// bytesDecompressed seems to be always equal to to_read
-		assert(bytesDecompressed == to_read);
-		offset -= bytesDecompressed;
+		data->resize(std::max<uint64_t>(m_runLength, offset + count));
+		data->resize(decode(data->data(), data->size()));
 	}
-	done = decompress(output, count);
+	
+	if (uint64_t(offset) >= data->size())
+		return 0;
+	
+	const int32_t done = std::min<uint64_t>(count, data->size() - offset);
+	memcpy(output, data->data() + offset, done);
+	
 	return done;
 }
 
@@ -4,6 +4,7 @@
 #include "dmg.h"
 #include "Reader.h"
 #include <memory>
+#include <vector>
 
 class DMGDecompressor
 {
@@ -12,14 +13,48 @@ protected:
 	int readSome(char** ptr);
 	void processed(int bytes);
 	uint64_t readerLength() const { return m_reader->length(); }
+	// Provides the complete compressed stream: in place if the reader holds it in memory,
+	// otherwise read into buffer with a single request. length receives the stream size.
+	const uint8_t* readAll(std::vector<uint8_t>& buffer, size_t& length);
+	
+	// Brings the decoder state back to the start of a new stream
+	virtual void reset() {}
 public:
 	virtual ~DMGDecompressor() {}
 	virtual int32_t decompress(void* output, int32_t count, int64_t offset) = 0;
 	
+	// Decompresses the whole run, runLength being its exact decompressed size.
+	// Decompressors with a faster path for this case override it.
+	virtual int32_t decompressRun(void* output, int32_t runLength) { return decompress(output, runLength, 0); }
+	
+	// Data a decompressor may keep about a run between reads, e.g. points to resume decoding from
+	struct RunState
+	{
+		virtual ~RunState() {}
+	};
+	
+	// Hands over the state kept for the run being decoded along with the run's decompressed length.
+	// The state starts out empty, the decompressor may fill it.
+	virtual void setRunState(std::shared_ptr<RunState>& /*state*/, uint64_t /*runLength*/) {}
+	
 	static DMGDecompressor* create(RunType runType, std::shared_ptr<Reader> reader);
+	
+	// Returns the decompressor into the pool instead of destroying it
+	struct Release
+	{
+		void operator()(DMGDecompressor* decompressor) const;
+	};
+	typedef std::unique_ptr<DMGDecompressor, Release> Handle;
+	
+	// Like create(), but reuses an idle decompressor (and its buffers) of the same type if there is one
+	static Handle acquire(RunType runType, std::shared_ptr<Reader> reader);
 private:
+	// Maximum number of idle decompressors kept per run type
+	enum { MAX_IDLE = 8 };
+	
 	std::shared_ptr<Reader> m_reader;
 	uint32_t m_pos;
+	RunType m_runType;
 	char m_buf[8*1024];
 };
 
@@ -7,6 +7,7 @@
 #include <openssl/evp.h>
 #include <memory>
 #include <sstream>
+#include <iomanip>
 #include "DMGPartition.h"
 #include "AppleDisk.h"
 #include "GPTDisk.h"
@@ -14,9 +15,12 @@
 #include "SubReader.h"
 #include "exceptions.h"
 
-DMGDisk::DMGDisk(std::shared_ptr<Reader> reader)
-	: m_reader(reader), m_zone(40000)
+DMGDisk::DMGDisk(std::shared_ptr<Reader> reader, std::shared_ptr<DiskRunCache> runCache)
+	: m_reader(reader), m_zone(2500, DMGPartition::ZONE_BLOCK_SIZE), m_runCache(runCache)
 {
+	// Runs are expensive to decode again, keep evicted blocks compressed for a while
+	m_zone.setCompressedLimit(32*1024*1024);
+
 	uint64_t offset = m_reader->length();
 
 	if (offset < 512)
@@ -30,9 +34,24 @@ DMGDisk::DMGDisk(std::shared_ptr<Reader> reader)
 	if (be(m_udif.fUDIFSignature) != UDIF_SIGNATURE)
 		throw io_error("Invalid KOLY block signature");
 	
+	m_image = imageIdentity(m_udif);
 	loadKoly(m_udif);
 }
 
+std::string DMGDisk::imageIdentity(const UDIFResourceFile& koly)
+{
+	std::ostringstream id;
+	
+	// The segment ID is random per image, the checksum and sizes tell apart images modified in place
+	id << std::hex << std::setfill('0')
+		<< std::setw(8) << be(koly.fUDIFSegmentID.data4) << std::setw(8) << be(koly.fUDIFSegmentID.data3)
+		<< std::setw(8) << be(koly.fUDIFSegmentID.data2) << std::setw(8) << be(koly.fUDIFSegmentID.data1)
+		<< '-' << std::setw(8) << be(koly.fUDIFMasterChecksum.data[0])
+		<< '-' << be(koly.fUDIFDataForkLength) << '-' << be(koly.fUDIFSectorCount);
+	
+	return id.str();
+}
+
 DMGDisk::~DMGDisk()
 {
 	xmlFreeDoc(m_kolyXML);
@@ -246,11 +265,11 @@ std::shared_ptr<Reader> DMGDisk::readerForPartition(int index)
 					m_reader->length() - data_offset));
 
 				return std::shared_ptr<Reader>(
-						new CachedReader(std::shared_ptr<Reader>(new DMGPartition(r, table)), &m_zone, partName.str())
+						new CachedReader(std::shared_ptr<Reader>(new DMGPartition(r, table, m_runCache, m_image)), &m_zone, partName.str())
 						);
 			} else {
 				return std::shared_ptr<Reader>(
-						new CachedReader(std::shared_ptr<Reader>(new DMGPartition(m_reader, table)), &m_zone, partName.str())
+						new CachedReader(std::shared_ptr<Reader>(new DMGPartition(m_reader, table, m_runCache, m_image)), &m_zone, partName.str())
 						);
 			}
 		}
@@ -4,21 +4,27 @@
 #include "Reader.h"
 #include "dmg.h"
 #include "CacheZone.h"
+#include "DiskRunCache.h"
+#include <string>
 #include <libxml/parser.h>
 #include <libxml/xpath.h>
 
 class DMGDisk : public PartitionedDisk
 {
 public:
-	DMGDisk(std::shared_ptr<Reader>reader);
+	// Decompressed runs are kept in runCache too, if given
+	DMGDisk(std::shared_ptr<Reader>reader, std::shared_ptr<DiskRunCache> runCache = nullptr);
 	~DMGDisk();
 
 	virtual const std::vector<Partition>& partitions() const override { return m_partitions; }
 	virtual std::shared_ptr<Reader> readerForPartition(int index) override;
 
 	static bool isDMG(std::shared_ptr<Reader> reader);
+	inline CacheZone* cacheZone() { return &m_zone; }
 private:
 	void loadKoly(const UDIFResourceFile& koly);
+	// Name of the image in the run cache, derived from the koly block
+	static std::string imageIdentity(const UDIFResourceFile& koly);
 	bool loadPartitionElements(xmlXPathContextPtr xpathContext, xmlNodeSetPtr nodes);
 	static bool parseNameAndType(const std::string& nameAndType, std::string& name, std::string& type);
 	static bool base64Decode(const std::string& input, std::vector<uint8_t>& output);
@@ -30,6 +36,8 @@ private:
 	UDIFResourceFile m_udif;
 	xmlDocPtr m_kolyXML;
 	CacheZone m_zone;
+	std::shared_ptr<DiskRunCache> m_runCache;
+	std::string m_image;
 };
 
 #endif
@@ -8,12 +8,14 @@
 //#include <cstdio>
 #include <iostream>
 #include "SubReader.h"
+#include "MemoryReader.h"
+#include "SharedRunCache.h"
 #include "exceptions.h"
 
 static const int SECTOR_SIZE = 512;
 
-DMGPartition::DMGPartition(std::shared_ptr<Reader> disk, BLKXTable* table)
-: m_disk(disk), m_table(table)
+DMGPartition::DMGPartition(std::shared_ptr<Reader> disk, BLKXTable* table, std::shared_ptr<DiskRunCache> runCache, const std::string& image)
+: m_disk(disk), m_table(table), m_runCache(runCache), m_image(image)
 {
 	for (uint32_t i = 0; i < be(m_table->blocksRunCount); i++)
 	{
@@ -54,9 +56,15 @@ void DMGPartition::adviseOptimalBlock(uint64_t offset, uint64_t& blockStart, uin
 	
 	// Issue #22: empty areas may be larger than 2**31 (causing bugs in callers).
 	// Moreover, there is no such thing as "optimal block" in zero-filled areas.
+	// Read them a whole cache block at a time, but without reaching into neighbouring runs.
 	RunType runType = RunType(be(m_table->runs[itRun->second].type));
 	if (runType == RunType::ZeroFill || runType == RunType::Unknown || runType == RunType::Raw)
-		Reader::adviseOptimalBlock(offset, blockStart, blockEnd);
+	{
+		const uint64_t aligned = offset & ~uint64_t(ZONE_BLOCK_SIZE - 1);
+		
+		blockStart = std::max(blockStart, aligned);
+		blockEnd = std::min(blockEnd, aligned + ZONE_BLOCK_SIZE);
+	}
 }
 
 int32_t DMGPartition::read(void* buf, int32_t count, uint64_t offset)
@@ -93,6 +101,118 @@ int32_t DMGPartition::read(void* buf, int32_t count, uint64_t offset)
 	return done;
 }
 
+void DMGPartition::readBatch(ReadRequest* requests, size_t count)
+{
+	std::vector<uint32_t> runs;
+	std::vector<std::vector<uint8_t>> inputs;
+	std::vector<ReadRequest> fetches;
+	std::vector<size_t> rawRequests, otherRequests;
+	uint64_t batchBytes = 0;
+	
+	// Nothing to win if the image is in memory already
+	if (m_disk->directData(0, 0) != nullptr)
+	{
+		Reader::readBatch(requests, count);
+		return;
+	}
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		const uint64_t end = std::min<uint64_t>(length(), requests[i].offset + requests[i].count);
+		std::map<uint64_t, uint32_t>::iterator itRun = m_sectors.upper_bound(requests[i].offset / SECTOR_SIZE);
+		
+		if (itRun == m_sectors.begin() || requests[i].offset >= end)
+		{
+			otherRequests.push_back(i);
+			continue;
+		}
+		
+		itRun--;
+		
+		// Requests within a single raw run go straight to the disk
+		const BLKXRun& firstRun = m_table->runs[itRun->second];
+		const uint64_t firstRunEnd = (itRun->first + be(firstRun.sectorCount)) * SECTOR_SIZE;
+		
+		if (RunType(be(firstRun.type)) == RunType::Raw && end <= firstRunEnd)
+		{
+			const uint64_t offsetInRun = requests[i].offset - itRun->first * SECTOR_SIZE;
+			
+			rawRequests.push_back(i);
+			fetches.push_back(ReadRequest{ requests[i].buf, int32_t(end - requests[i].offset),
+					be(firstRun.compOffset) + be(m_table->dataStart) + offsetInRun, 0 });
+			continue;
+		}
+		
+		otherRequests.push_back(i);
+		
+		// Find the compressed runs touched by the request
+		for (; itRun != m_sectors.end() && itRun->first * SECTOR_SIZE < end && batchBytes < MAX_BATCH_BYTES; itRun++)
+		{
+			const BLKXRun& run = m_table->runs[itRun->second];
+			
+			switch (RunType(be(run.type)))
+			{
+				case RunType::Zlib:
+				case RunType::Bzip2:
+				case RunType::ADC:
+				case RunType::LZFSE:
+					// No need for the compressed data of runs the run cache has
+					if (m_runCache && m_runCache->contains(DiskRunCache::runName(m_image, be(run.compOffset) + be(m_table->dataStart)),
+							be(run.sectorCount) * SECTOR_SIZE))
+						break;
+					if (std::find(runs.begin(), runs.end(), itRun->second) == runs.end())
+					{
+						runs.push_back(itRun->second);
+						batchBytes += be(run.compLength);
+					}
+					break;
+				default:
+					break;
+			}
+		}
+	}
+	
+	// Prefetching a lone run would only add a copy
+	if (runs.size() == 1 && rawRequests.empty())
+		runs.clear();
+	
+	// Read raw data and the compressed runs in a single batch, then decompress as usual
+	inputs.resize(runs.size());
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		const BLKXRun& run = m_table->runs[runs[i]];
+		
+		inputs[i].resize(be(run.compLength));
+		fetches.push_back(ReadRequest{ inputs[i].data(), int32_t(inputs[i].size()), be(run.compOffset) + be(m_table->dataStart), 0 });
+	}
+	
+	m_disk->readBatch(fetches.data(), fetches.size());
+	
+	for (size_t i = 0; i < rawRequests.size(); i++)
+		requests[rawRequests[i]].result = fetches[i].result;
+	
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		const ReadRequest& fetch = fetches[rawRequests.size() + i];
+		
+		if (fetch.result == fetch.count)
+			m_prefetchedRuns[runs[i]] = std::make_shared<MemoryReader>(std::move(inputs[i]));
+	}
+	
+	try
+	{
+		for (size_t i : otherRequests)
+			requests[i].result = read(requests[i].buf, requests[i].count, requests[i].offset);
+	}
+	catch (...)
+	{
+		m_prefetchedRuns.clear();
+		throw;
+	}
+	
+	m_prefetchedRuns.clear();
+}
+
 int32_t DMGPartition::readRun(void* buf, int32_t runIndex, uint64_t offsetInSector, int32_t count)
 {
 	BLKXRun* run = &m_table->runs[runIndex];
@@ -122,22 +242,116 @@ int32_t DMGPartition::readRun(void* buf, int32_t runIndex, uint64_t offsetInSect
 		case RunType::Bzip2:
 		case RunType::ADC:
 		{
-			std::unique_ptr<DMGDecompressor> decompressor;
+			DMGDecompressor::Handle decompressor;
 			std::shared_ptr<Reader> subReader;
-			
-			subReader.reset(new SubReader(m_disk, be(run->compOffset) + be(m_table->dataStart), be(run->compLength)));
-			decompressor.reset(DMGDecompressor::create(runType, subReader));
-			
-			if (!decompressor)
-				throw std::logic_error("DMGDecompressor::create() returned nullptr!");
+			const uint64_t runOffset = be(run->compOffset) + be(m_table->dataStart);
+			std::string diskName, sharedName;
+			SharedRunCache* sharedCache = SharedRunCache::instance();
 
 			unsigned long long int compLength = be(run->sectorCount)*512;
 			if ( offsetInSector > compLength )
 				return 0;
 			if ( offsetInSector + count > compLength )
 				count = compLength - offsetInSector;
+			
+			if (m_runCache)
+			{
+				diskName = DiskRunCache::runName(m_image, runOffset);
+				
+				std::shared_ptr<Reader> cached = m_runCache->get(diskName, compLength);
+				
+				if (cached && cached->read(buf, count, offsetInSector) == count)
+					return count;
+			}
+			
+			auto itPrefetched = m_prefetchedRuns.find(runIndex);
+			
+			if (itPrefetched != m_prefetchedRuns.end())
+				subReader = itPrefetched->second;
+			else
+				subReader.reset(new SubReader(m_disk, runOffset, be(run->compLength)));
+			
+			if (sharedCache->enabled())
+			{
+				auto itName = m_sharedNames.find(runIndex);
+				
+				if (itName != m_sharedNames.end())
+					sharedName = itName->second;
+				else
+				{
+					// The name comes from the compressed data, which the decompressor then gets from memory
+					const uint64_t length = subReader->length();
+					const uint8_t* compressed = subReader->directData(0, length);
+					
+					if (compressed == nullptr)
+					{
+						std::vector<uint8_t> data(length);
+						
+						if (subReader->read(data.data(), length, 0) != int32_t(length))
+							throw io_error("Cannot read compressed run");
+						
+						subReader = std::make_shared<MemoryReader>(std::move(data));
+						compressed = subReader->directData(0, length);
+					}
+					
+					sharedName = SharedRunCache::runName(runType, compressed, length, compLength);
+					m_sharedNames[runIndex] = sharedName;
+				}
+				
+				if (sharedCache->read(sharedName, compLength, buf, offsetInSector, count))
+					return count;
+			}
+			
+			decompressor = DMGDecompressor::acquire(runType, subReader);
+			
+			if (!decompressor)
+				throw std::logic_error("DMGDecompressor::create() returned nullptr!");
 
-			int32_t dec = decompressor->decompress((uint8_t*)buf, count, offsetInSector);
+			int32_t dec;
+			
+			auto storeRun = [&](const void* data) {
+				if (m_runCache)
+					m_runCache->store(diskName, data, compLength);
+				if (!sharedName.empty())
+					sharedCache->store(sharedName, data, compLength);
+			};
+			
+			if (offsetInSector == 0 && uint64_t(count) == compLength)
+			{
+				dec = decompressor->decompressRun(buf, count);
+				
+				if (dec == count)
+					storeRun(buf);
+			}
+			else if (m_runCache || !sharedName.empty())
+			{
+				// Decode all of the run for the caches, further reads of it then come from there
+				std::vector<uint8_t> data(compLength);
+				
+				dec = decompressor->decompressRun(data.data(), data.size());
+				if (uint64_t(dec) == compLength)
+				{
+					storeRun(data.data());
+					memcpy(buf, &data[offsetInSector], count);
+					dec = count;
+				}
+			}
+			else
+			{
+				// Partial reads may profit from what earlier reads of this run left behind
+				if (!m_runStates.count(runIndex))
+				{
+					if (m_runStates.size() >= MAX_RUN_STATES)
+					{
+						m_runStates.erase(m_runStateOrder.front());
+						m_runStateOrder.pop_front();
+					}
+					m_runStateOrder.push_back(runIndex);
+				}
+				
+				decompressor->setRunState(m_runStates[runIndex], compLength);
+				dec = decompressor->decompress((uint8_t*)buf, count, offsetInSector);
+			}
 			if (dec < count)
 				throw io_error("Error decompressing stream");
 			return count;
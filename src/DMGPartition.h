@@ -4,22 +4,47 @@
 #include "dmg.h"
 #include <memory>
 #include <map>
+#include <list>
+#include <string>
+#include "DMGDecompressor.h"
+#include "DiskRunCache.h"
 
 class DMGPartition : public Reader
 {
 public:
-	DMGPartition(std::shared_ptr<Reader> disk, BLKXTable* table);
+	// Decompressed runs are looked up in and added to runCache if there is one, image identifies the DMG there
+	DMGPartition(std::shared_ptr<Reader> disk, BLKXTable* table,
+			std::shared_ptr<DiskRunCache> runCache = nullptr, const std::string& image = std::string());
     ~DMGPartition();
 	
 	virtual int32_t read(void* buf, int32_t count, uint64_t offset) override;
+	virtual void readBatch(ReadRequest* requests, size_t count) override;
 	virtual uint64_t length() override;
 	virtual void adviseOptimalBlock(uint64_t offset, uint64_t& blockStart, uint64_t& blockEnd) override;
+	
+	// Block size of the cache zone over partitions, runs that aren't compressed are advised in blocks of this size
+	enum { ZONE_BLOCK_SIZE = 64*1024 };
 private:
 	int32_t readRun(void* buf, int32_t runIndex, uint64_t offsetInSector, int32_t count);
 private:
 	std::shared_ptr<Reader> m_disk;
 	BLKXTable* m_table;
 	std::map<uint64_t, uint32_t> m_sectors;
+	
+	// Decompressor state of recently read runs (run index -> state)
+	std::map<uint32_t, std::shared_ptr<DMGDecompressor::RunState>> m_runStates;
+	std::list<uint32_t> m_runStateOrder;
+	enum { MAX_RUN_STATES = 4 };
+	
+	// Compressed data of runs fetched ahead by readBatch() (run index -> data)
+	std::map<uint32_t, std::shared_ptr<Reader>> m_prefetchedRuns;
+	enum { MAX_BATCH_BYTES = 16*1024*1024 };
+	
+	std::shared_ptr<DiskRunCache> m_runCache;
+	std::string m_image;
+	
+	// Names of runs in the SharedRunCache (run index -> name), hashing the compressed data once per run
+	std::map<uint32_t, std::string> m_sharedNames;
 };
 
 #endif
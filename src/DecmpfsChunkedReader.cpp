@@ -0,0 +1,281 @@
+#include "DecmpfsChunkedReader.h"
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include "exceptions.h"
+#include "be.h"
+#include "ThreadPool.h"
+
+// HFS+ compresses data in 64KB blocks
+static const unsigned int RUN_LENGTH = 64*1024;
+
+// Enough for the compression table of a file up to ~32 MB
+static const unsigned int TABLE_PREFETCH = 4096;
+
+DecmpfsChunkedReader::DecmpfsChunkedReader(std::shared_ptr<Reader> parent, uint64_t uncompressedSize, ChunkTable table)
+: m_reader(parent), m_uncompressedSize(uncompressedSize), m_chunkSize(RUN_LENGTH)
+{
+	switch (table)
+	{
+		case ChunkTable::OffsetLengthPairs:
+			loadOffsetLengthPairs();
+			break;
+		case ChunkTable::Offsets:
+			loadOffsets();
+			break;
+		case ChunkTable::SingleRun:
+			// This is only used for data stored within extended attributes.
+			// In this case, the reader here is a MemoryReader with a small amount of data,
+			// thus it is OK to cast the length to uint32_t.
+			m_offsets.push_back(std::pair<uint32_t,uint32_t>(0, m_reader->length()));
+			m_chunkSize = std::max<uint64_t>(uncompressedSize, 1);
+			break;
+	}
+}
+
+void DecmpfsChunkedReader::loadOffsetLengthPairs()
+{
+	// read the compression table (little endian)
+	// uint32_t numEntries
+	// uint32_t offsets[(num_entries+1)*2] (offset, length)
+	//
+	// Each offset points to the start of a 64 KB block
+	
+	uint32_t numEntries;
+	std::vector<uint8_t> table(TABLE_PREFETCH);
+	int32_t rd;
+	const uint32_t* entries;
+	
+	// The table is usually small: fetch it together with its header in one read
+	rd = m_reader->read(&table[0], table.size(), 0);
+	if (rd < int32_t(sizeof(numEntries)))
+		throw io_error("Short read of compression map");
+	
+	memcpy(&numEntries, &table[0], sizeof(numEntries));
+	numEntries = le(numEntries);
+	
+	const uint64_t tableLength = sizeof(numEntries) + sizeof(uint32_t) * 2 * (uint64_t(numEntries)+1);
+	if (tableLength > uint64_t(rd))
+	{
+		if (tableLength > m_reader->length())
+			throw io_error("Short read of compression map entries");
+		
+		table.resize(tableLength);
+		if (m_reader->read(&table[rd], tableLength - rd, rd) != int32_t(tableLength - rd))
+			throw io_error("Short read of compression map entries");
+	}
+	
+	entries = reinterpret_cast<const uint32_t*>(&table[sizeof(numEntries)]);
+	m_offsets.reserve(numEntries+1);
+	
+	for (size_t i = 0; i < numEntries+1; i++)
+		m_offsets.push_back(std::make_pair(le(entries[i*2]), le(entries[i*2+1])));
+}
+
+void DecmpfsChunkedReader::loadOffsets()
+{
+	// read the compression table (little endian)
+	// uint32_t offsets[numChunks+1]
+	//
+	// The first offset points right after the table, hence also gives its size
+	
+	uint32_t tableLength;
+	std::vector<uint8_t> table(TABLE_PREFETCH);
+	int32_t rd;
+	const uint32_t* entries;
+	
+	rd = m_reader->read(&table[0], table.size(), 0);
+	if (rd < int32_t(sizeof(tableLength)))
+		throw io_error("Short read of compression map");
+	
+	memcpy(&tableLength, &table[0], sizeof(tableLength));
+	tableLength = le(tableLength);
+	
+	if (tableLength < 2*sizeof(uint32_t) || tableLength % sizeof(uint32_t) || tableLength > m_reader->length())
+		throw io_error("Invalid compression map");
+	
+	if (tableLength > uint32_t(rd))
+	{
+		table.resize(tableLength);
+		if (m_reader->read(&table[rd], tableLength - rd, rd) != int32_t(tableLength - rd))
+			throw io_error("Short read of compression map entries");
+	}
+	
+	entries = reinterpret_cast<const uint32_t*>(&table[0]);
+	m_offsets.reserve(tableLength / sizeof(uint32_t) - 1);
+	
+	for (size_t i = 0; i < tableLength / sizeof(uint32_t) - 1; i++)
+	{
+		const uint32_t start = le(entries[i]), end = le(entries[i+1]);
+		
+		if (end < start)
+			throw io_error("Invalid compression map");
+		m_offsets.push_back(std::make_pair(start, end - start));
+	}
+}
+
+void DecmpfsChunkedReader::adviseOptimalBlock(uint64_t offset, uint64_t& blockStart, uint64_t& blockEnd)
+{
+	uint64_t window = m_chunkSize;
+	
+	// Reading sequentially: ask for several chunks, so that they can be decoded in parallel
+	if (continuesStream(offset))
+		window *= std::min<unsigned int>(ThreadPool::instance()->concurrency(), MAX_WINDOW_CHUNKS);
+	
+	blockStart = offset - (offset % m_chunkSize);
+	blockEnd = std::min(blockStart + window, length());
+}
+
+bool DecmpfsChunkedReader::continuesStream(uint64_t offset) const
+{
+	return std::find(m_streamEnds.begin(), m_streamEnds.end(), offset) != m_streamEnds.end();
+}
+
+uint32_t DecmpfsChunkedReader::chunkLength(uint32_t chunkIndex) const
+{
+	return std::min<uint64_t>(m_chunkSize, m_uncompressedSize - uint64_t(chunkIndex) * m_chunkSize);
+}
+
+void DecmpfsChunkedReader::decodeChunk(uint32_t chunkIndex, uint8_t* out)
+{
+	uint32_t inLength;
+	int32_t rd;
+	
+	if (chunkIndex >= m_offsets.size())
+		throw io_error("Chunk index out of range");
+	
+	// The compressed length is known up front, fetch the whole chunk at once
+	inLength = m_offsets[chunkIndex].second;
+	if (m_inputBuffer.size() < inLength)
+		m_inputBuffer.resize(inLength);
+	
+	rd = m_reader->read(m_inputBuffer.data(), inLength, m_offsets[chunkIndex].first);
+	if (rd <= 0)
+		throw io_error("Short read of compressed chunk");
+	
+	decompressChunk(m_inputBuffer.data(), rd, out, chunkLength(chunkIndex));
+}
+
+bool DecmpfsChunkedReader::decodeChunksParallel(uint32_t firstChunk, uint32_t numChunks, uint8_t* out)
+{
+	const uint32_t lastChunk = firstChunk + numChunks - 1;
+	std::vector<uint8_t> input;
+	uint64_t start, end;
+	
+	if (lastChunk >= m_offsets.size())
+		return false;
+	
+	// Compressed chunks are normally stored back to back; fetch them all with one read.
+	// The parent reader isn't thread safe anyway.
+	start = m_offsets[firstChunk].first;
+	end = start;
+	for (uint32_t i = firstChunk; i <= lastChunk; i++)
+	{
+		if (m_offsets[i].first < end || m_offsets[i].second == 0)
+			return false;
+		end = uint64_t(m_offsets[i].first) + m_offsets[i].second;
+	}
+	if (end - start > uint64_t(MAX_WINDOW_CHUNKS) * m_chunkSize * 2)
+		return false;
+	
+	input.resize(end - start);
+	if (m_reader->read(input.data(), input.size(), start) != int32_t(input.size()))
+		throw io_error("Short read of compressed chunk");
+	
+	ThreadPool::instance()->parallelFor(numChunks, [&](size_t i) {
+		const uint32_t chunkIndex = firstChunk + i;
+		
+		decompressChunk(&input[m_offsets[chunkIndex].first - start], m_offsets[chunkIndex].second,
+				out + uint64_t(i) * m_chunkSize, chunkLength(chunkIndex));
+	});
+	
+	return true;
+}
+
+const uint8_t* DecmpfsChunkedReader::getChunk(uint32_t chunkIndex)
+{
+	for (auto it = m_chunkCache.begin(); it != m_chunkCache.end(); it++)
+	{
+		if (it->index == chunkIndex)
+		{
+			m_chunkCache.splice(m_chunkCache.begin(), m_chunkCache, it);
+			return m_chunkCache.front().data.data();
+		}
+	}
+	
+	// Reuse the least recently used entry's buffer
+	if (m_chunkCache.size() >= CHUNK_CACHE_SIZE)
+		m_chunkCache.splice(m_chunkCache.begin(), m_chunkCache, std::prev(m_chunkCache.end()));
+	else
+		m_chunkCache.emplace_front();
+	
+	CachedChunk& chunk = m_chunkCache.front();
+	
+	// Invalidate first, in case decoding fails
+	chunk.index = UINT32_MAX;
+	chunk.data.resize(chunkLength(chunkIndex));
+	decodeChunk(chunkIndex, chunk.data.data());
+	chunk.index = chunkIndex;
+	
+	return chunk.data.data();
+}
+
+int32_t DecmpfsChunkedReader::read(void* buf, int32_t count, uint64_t offset)
+{
+	int32_t done = 0;
+	
+	if (offset >= m_uncompressedSize)
+		return 0;
+	if (offset+count > m_uncompressedSize)
+		count = m_uncompressedSize - offset;
+	
+	while (done < count)
+	{
+		const uint64_t pos = offset + done;
+		const uint32_t chunkIndex = pos / m_chunkSize;
+		const uint32_t chunkOffset = pos % m_chunkSize;
+		const uint32_t length = chunkLength(chunkIndex);
+		const uint32_t thisTime = std::min<uint32_t>(length - chunkOffset, count - done);
+		uint8_t* dest = static_cast<uint8_t*>(buf) + done;
+		
+		if (chunkOffset == 0 && thisTime == length)
+		{
+			// Whole chunks go straight into the caller's buffer, several of them at once if possible
+			uint64_t wholeChunks = 1;
+			
+			if (offset + count == m_uncompressedSize)
+				wholeChunks = (count - done + m_chunkSize - 1) / m_chunkSize;
+			else
+				wholeChunks = (count - done) / m_chunkSize;
+			
+			if (wholeChunks > 1 && decodeChunksParallel(chunkIndex, wholeChunks, dest))
+			{
+				done += std::min<uint64_t>(wholeChunks * m_chunkSize, count - done);
+				continue;
+			}
+			
+			decodeChunk(chunkIndex, dest);
+		}
+		else
+			memcpy(dest, getChunk(chunkIndex) + chunkOffset, thisTime);
+		
+		done += thisTime;
+	}
+	
+	auto stream = std::find(m_streamEnds.begin(), m_streamEnds.end(), offset);
+	
+	if (stream == m_streamEnds.end())
+	{
+		stream = m_streamEnds.begin() + m_nextStream;
+		m_nextStream = (m_nextStream + 1) % MAX_STREAMS;
+	}
+	*stream = offset + done;
+	
+	return done;
+}
+
+uint64_t DecmpfsChunkedReader::length()
+{
+	return m_uncompressedSize;
+}
@@ -0,0 +1,71 @@
+#ifndef DECMPFSCHUNKEDREADER_H
+#define DECMPFSCHUNKEDREADER_H
+#include "Reader.h"
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <list>
+#include <array>
+#include <cstdint>
+
+// Common base for decmpfs compressed files, which are stored as a table of independently
+// compressed 64 KB chunks (or as a single chunk when stored inline in the xattr).
+// Subclasses only provide decompression of a single chunk.
+class DecmpfsChunkedReader : public Reader
+{
+public:
+	virtual int32_t read(void* buf, int32_t count, uint64_t offset) override;
+	virtual uint64_t length() override;
+	virtual void adviseOptimalBlock(uint64_t offset, uint64_t& blockStart, uint64_t& blockEnd) override;
+protected:
+	enum class ChunkTable
+	{
+		SingleRun, // the whole parent reader is one chunk
+		OffsetLengthPairs, // zlib: uint32_t count, then (offset, length) pairs
+		Offsets // LZVN/LZFSE: uint32_t offsets, chunk i spans offsets[i] till offsets[i+1]
+	};
+	
+	DecmpfsChunkedReader(std::shared_ptr<Reader> parent, uint64_t uncompressedSize, ChunkTable table);
+	
+	// Decompresses exactly outLength bytes of a single chunk.
+	// Called concurrently from multiple threads for different chunks.
+	virtual void decompressChunk(const uint8_t* in, uint32_t inLength, uint8_t* out, uint32_t outLength) = 0;
+private:
+	void loadOffsetLengthPairs();
+	void loadOffsets();
+	
+	// Size of the uncompressed data of the given chunk
+	uint32_t chunkLength(uint32_t chunkIndex) const;
+	// Decompresses a whole chunk into out (chunkLength() bytes)
+	void decodeChunk(uint32_t chunkIndex, uint8_t* out);
+	// Decodes a range of whole chunks on the thread pool, returns false if it couldn't
+	bool decodeChunksParallel(uint32_t firstChunk, uint32_t numChunks, uint8_t* out);
+	// Returns the decompressed chunk, decoding it if it isn't cached
+	const uint8_t* getChunk(uint32_t chunkIndex);
+	// Whether a read at offset continues one of the recent sequential streams
+	bool continuesStream(uint64_t offset) const;
+private:
+	struct CachedChunk
+	{
+		uint32_t index;
+		std::vector<uint8_t> data;
+	};
+	
+	// Number of decompressed chunks kept per file
+	enum { CHUNK_CACHE_SIZE = 4 };
+	// Maximum number of chunks advised to be read at once during sequential reads
+	enum { MAX_WINDOW_CHUNKS = 16 };
+	// Sequential streams told apart, the file may be read through several handles at once
+	enum { MAX_STREAMS = 4 };
+	
+	std::shared_ptr<Reader> m_reader;
+	uint64_t m_uncompressedSize;
+	uint32_t m_chunkSize;
+	std::vector<uint8_t> m_inputBuffer;
+	std::list<CachedChunk> m_chunkCache; // most recently used first
+	std::array<uint64_t, MAX_STREAMS> m_streamEnds {{ UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX }};
+	unsigned int m_nextStream = 0; // slot replaced by the next new stream
+	std::vector<std::pair<uint32_t,uint32_t>> m_offsets; // (offset, length)
+};
+
+#endif
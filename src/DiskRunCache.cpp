@@ -0,0 +1,197 @@
+#include "DiskRunCache.h"
+#include "MmapReader.h"
+#include "FileReader.h"
+#include "exceptions.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+static const char RUN_SUFFIX[] = ".run";
+
+DiskRunCache::DiskRunCache(const std::string& directory, uint64_t maxBytes)
+: m_directory(directory), m_maxBytes(maxBytes), m_usedBytes(0)
+{
+	struct stat st;
+
+	if (::mkdir(m_directory.c_str(), 0755) == -1 && errno != EEXIST)
+		throw io_error("Cannot create cache directory " + m_directory + ": " + strerror(errno));
+
+	if (::stat(m_directory.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))
+		throw io_error("Cache directory " + m_directory + " is not a directory");
+
+	// Also finds out how much is cached already
+	evict();
+}
+
+std::string DiskRunCache::runName(const std::string& image, uint64_t runOffset)
+{
+	std::ostringstream name;
+
+	name << image << '-' << std::hex << runOffset;
+	return name.str();
+}
+
+std::string DiskRunCache::runPath(const std::string& name) const
+{
+	return m_directory + '/' + name + RUN_SUFFIX;
+}
+
+std::shared_ptr<Reader> DiskRunCache::get(const std::string& name, uint64_t runLength)
+{
+	const std::string path = runPath(name);
+	std::shared_ptr<Reader> reader;
+
+	try
+	{
+		try
+		{
+			reader.reset(new MmapReader(path));
+		}
+		catch (const io_error&)
+		{
+			// Not mapped on network and removable file systems, read it the plain way there
+			reader.reset(new FileReader(path));
+		}
+	}
+	catch (const std::runtime_error&)
+	{
+		return nullptr;
+	}
+
+	if (reader->length() != runLength)
+	{
+#ifdef DEBUG
+		std::cerr << "Ignoring cached run " << path << " of unexpected length\n";
+#endif
+		return nullptr;
+	}
+
+	// The modification time orders runs for eviction
+	::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+
+	return reader;
+}
+
+bool DiskRunCache::contains(const std::string& name, uint64_t runLength) const
+{
+	struct stat st;
+
+	return ::stat(runPath(name).c_str(), &st) == 0 && uint64_t(st.st_size) == runLength;
+}
+
+void DiskRunCache::store(const std::string& name, const void* data, uint64_t length)
+{
+	const std::string path = runPath(name);
+	const uint8_t* pos = static_cast<const uint8_t*>(data);
+	uint64_t left = length;
+	int fd;
+
+	if (length > m_maxBytes)
+		return;
+
+	// A name of its own for every writer, threads and processes may store the same run at once
+	std::vector<char> tempPath(path.begin(), path.end());
+	const char suffix[] = ".tmpXXXXXX";
+	tempPath.insert(tempPath.end(), suffix, suffix + sizeof(suffix));
+
+	fd = ::mkstemp(tempPath.data());
+	if (fd == -1)
+		return;
+
+	// Readable by other processes sharing the directory, like any other file
+	::fchmod(fd, 0644);
+
+	while (left > 0)
+	{
+		ssize_t done = ::write(fd, pos, left);
+
+		if (done <= 0)
+		{
+			if (done == -1 && errno == EINTR)
+				continue;
+			break;
+		}
+
+		pos += done;
+		left -= done;
+	}
+
+	if (::close(fd) == -1 || left > 0 || ::rename(tempPath.data(), path.c_str()) == -1)
+	{
+		::unlink(tempPath.data());
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_usedBytes += length;
+	if (m_usedBytes > m_maxBytes)
+		evict();
+}
+
+void DiskRunCache::evict()
+{
+	struct CachedRun
+	{
+		std::string path;
+		struct timespec used;
+		uint64_t size;
+	};
+
+	std::vector<CachedRun> runs;
+	DIR* dir = ::opendir(m_directory.c_str());
+	struct dirent* ent;
+	uint64_t total = 0;
+
+	if (!dir)
+		return;
+
+	while ((ent = ::readdir(dir)) != nullptr)
+	{
+		const size_t nameLength = strlen(ent->d_name);
+		struct stat st;
+		CachedRun run;
+
+		// Only ever touch our own files
+		if (nameLength <= sizeof(RUN_SUFFIX) - 1 || strcmp(ent->d_name + nameLength - (sizeof(RUN_SUFFIX) - 1), RUN_SUFFIX) != 0)
+			continue;
+
+		run.path = m_directory + '/' + ent->d_name;
+		if (::stat(run.path.c_str(), &st) == -1 || !S_ISREG(st.st_mode))
+			continue;
+
+		run.used = st.st_mtim;
+		run.size = st.st_size;
+		total += run.size;
+		runs.push_back(std::move(run));
+	}
+
+	::closedir(dir);
+
+	if (total > m_maxBytes)
+	{
+		// Go down to 90 % of the budget, so that the next few runs don't need another scan
+		const uint64_t target = m_maxBytes - m_maxBytes / 10;
+
+		std::sort(runs.begin(), runs.end(), [](const CachedRun& a, const CachedRun& b) {
+			return a.used.tv_sec < b.used.tv_sec || (a.used.tv_sec == b.used.tv_sec && a.used.tv_nsec < b.used.tv_nsec);
+		});
+
+		// Processes that have a run mapped keep their copy after the unlink
+		for (size_t i = 0; i < runs.size() && total > target; i++)
+		{
+			if (::unlink(runs[i].path.c_str()) == 0 || errno == ENOENT)
+				total -= runs[i].size;
+		}
+	}
+
+	m_usedBytes = total;
+}
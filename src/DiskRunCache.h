@@ -0,0 +1,43 @@
+#ifndef DISKRUNCACHE_H
+#define DISKRUNCACHE_H
+#include "Reader.h"
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Keeps decompressed DMG runs as plain files in a directory, one file per run name.
+// The files survive restarts and are mapped straight into memory when read (where
+// MmapReader allows it), so several processes mounting the same image share them. Files are written under
+// a temporary name and renamed, readers never see a partial run.
+class DiskRunCache
+{
+public:
+	// Throws io_error if the directory cannot be created
+	DiskRunCache(const std::string& directory, uint64_t maxBytes);
+
+	// Name of a run by its position in an image
+	static std::string runName(const std::string& image, uint64_t runOffset);
+	
+	// Returns the run, or nullptr if it isn't cached
+	std::shared_ptr<Reader> get(const std::string& name, uint64_t runLength);
+	// Checks for the run without mapping it or counting as a use
+	bool contains(const std::string& name, uint64_t runLength) const;
+	// Failures are ignored, the run is simply decompressed again next time
+	void store(const std::string& name, const void* data, uint64_t length);
+
+	inline const std::string& directory() const { return m_directory; }
+private:
+	std::string runPath(const std::string& name) const;
+	// Deletes the least recently used runs until the directory fits into its budget again
+	void evict();
+private:
+	std::string m_directory;
+	uint64_t m_maxBytes;
+
+	// Size of the cached runs as last seen, other processes may add to it unnoticed
+	uint64_t m_usedBytes;
+	std::mutex m_mutex;
+};
+
+#endif
@@ -3,13 +3,37 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <cstring>
+#include <cerrno>
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
 #include "exceptions.h"
+#include "ThreadPool.h"
+#ifdef COMPILE_WITH_LIBURING
+#	include <liburing.h>
+#endif
+
+namespace
+{
+	// Reads block rather than compute, so they get their own workers
+	// instead of competing with decompression for the CPU-sized pool
+	const unsigned int IO_THREADS = 4;
+	
+	// Requests in flight at once with io_uring
+	const unsigned int RING_ENTRIES = 32;
+	
+	// Limit for requests merged into one vectored read, well below IOV_MAX
+	const size_t MAX_SPAN_REQUESTS = 64;
+}
 
 FileReader::FileReader(const std::string& path)
-: m_fd(-1)
+: m_fd(-1), m_length(0)
+#ifdef COMPILE_WITH_LIBURING
+, m_ringFailed(false)
+#endif
 {
+	struct stat st;
+
 	m_fd = ::open(path.c_str(), O_RDONLY);
 
 	if (m_fd == -1)
@@ -19,10 +43,20 @@ FileReader::FileReader(const std::string& path)
 #endif
 		throw file_not_found_error(path);
 	}
+	
+	// Images don't change while in use, so the length is only determined once
+	if (::fstat(m_fd, &st) == 0 && S_ISREG(st.st_mode))
+		m_length = st.st_size;
+	else
+		m_length = ::lseek(m_fd, 0, SEEK_END); // block devices
 }
 
 FileReader::~FileReader()
 {
+#ifdef COMPILE_WITH_LIBURING
+	if (m_ring)
+		io_uring_queue_exit(m_ring.get());
+#endif
 	if (m_fd != -1)
 		::close(m_fd);
 }
@@ -39,5 +73,187 @@ int32_t FileReader::read(void* buf, int32_t count, uint64_t offset)
 
 uint64_t FileReader::length()
 {
-	return ::lseek(m_fd, 0, SEEK_END);
+	return m_length;
+}
+
+void FileReader::readBatch(ReadRequest* requests, size_t count)
+{
+	static ThreadPool ioPool(IO_THREADS - 1);
+	std::vector<ReadRequest*> sorted;
+	std::vector<Span> spans;
+	
+	if (count < 2)
+	{
+		Reader::readBatch(requests, count);
+		return;
+	}
+	
+	for (size_t i = 0; i < count; i++)
+		sorted.push_back(&requests[i]);
+	
+	std::sort(sorted.begin(), sorted.end(), [](const ReadRequest* a, const ReadRequest* b) {
+		return a->offset < b->offset;
+	});
+	
+	// Requests continuing one another become a single vectored read
+	for (ReadRequest* req : sorted)
+	{
+		if (!spans.empty())
+		{
+			const ReadRequest* prev = spans.back().requests.back();
+			
+			if (prev->offset + prev->count == req->offset && spans.back().requests.size() < MAX_SPAN_REQUESTS)
+			{
+				spans.back().requests.push_back(req);
+				spans.back().iov.push_back(iovec{ req->buf, size_t(req->count) });
+				continue;
+			}
+		}
+		
+		spans.push_back(Span{ req->offset, { req }, { iovec{ req->buf, size_t(req->count) } } });
+	}
+	
+	if (spans.size() == 1)
+	{
+		readSpan(spans[0]);
+		return;
+	}
+	
+#ifdef COMPILE_WITH_LIBURING
+	if (readBatchRing(spans))
+		return;
+#endif
+	
+	// preadv() is safe to issue concurrently on the same descriptor
+	ioPool.parallelFor(spans.size(), [&](size_t i) {
+		readSpan(spans[i]);
+	});
+}
+
+void FileReader::readSpan(Span& span)
+{
+	if (m_fd == -1)
+		completeSpan(span, -1);
+	else
+		completeSpan(span, ::preadv(m_fd, span.iov.data(), span.iov.size(), span.offset));
 }
+
+void FileReader::completeSpan(Span& span, ssize_t total)
+{
+	// Hand out the bytes read to the requests in order, a short read ends within one of them
+	for (ReadRequest* req : span.requests)
+	{
+		if (total < 0)
+			req->result = -1;
+		else
+		{
+			req->result = std::min<ssize_t>(req->count, total);
+			total -= req->result;
+		}
+	}
+}
+
+#ifdef COMPILE_WITH_LIBURING
+
+bool FileReader::readBatchRing(std::vector<Span>& spans)
+{
+	std::lock_guard<std::mutex> lock(m_ringMutex);
+	std::vector<bool> done(spans.size(), false);
+	size_t submitted = 0, completed = 0;
+	int ret;
+	
+	if (!m_ring)
+	{
+		if (m_ringFailed)
+			return false;
+		
+		std::unique_ptr<io_uring> ring(new io_uring);
+		
+		if (io_uring_queue_init(RING_ENTRIES, ring.get(), 0) < 0)
+		{
+			m_ringFailed = true;
+			return false;
+		}
+		
+		m_ring = std::move(ring);
+	}
+	
+	auto reap = [&](struct io_uring_cqe* cqe) {
+		Span* span = static_cast<Span*>(io_uring_cqe_get_data(cqe));
+		
+		completeSpan(*span, (cqe->res < 0) ? -1 : cqe->res);
+		done[span - spans.data()] = true;
+		io_uring_cqe_seen(m_ring.get(), cqe);
+		completed++;
+	};
+	
+	while (completed < spans.size())
+	{
+		struct io_uring_cqe* cqe;
+		
+		// Keep the ring as full as possible
+		while (submitted < spans.size() && submitted - completed < RING_ENTRIES)
+		{
+			struct io_uring_sqe* sqe = io_uring_get_sqe(m_ring.get());
+			Span& span = spans[submitted];
+			
+			if (!sqe)
+				break;
+			
+			io_uring_prep_readv(sqe, m_fd, span.iov.data(), span.iov.size(), span.offset);
+			io_uring_sqe_set_data(sqe, &span);
+			submitted++;
+		}
+		
+		ret = io_uring_submit_and_wait(m_ring.get(), 1);
+		
+		// A signal (FUSE gets plenty) or a momentary lack of kernel resources
+		if (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY)
+			continue;
+		if (ret < 0)
+			break;
+		
+		// Reap everything that has completed so far
+		while (io_uring_peek_cqe(m_ring.get(), &cqe) == 0)
+			reap(cqe);
+	}
+	
+	if (completed == spans.size())
+		return true;
+	
+	const int error = ret;
+	
+	// The ring is broken. The kernel still writes into the spans it took, so wait for all of them
+	// before they go out of scope. Whatever it didn't take yet is discarded with the ring.
+	size_t inFlight = submitted - io_uring_sq_ready(m_ring.get()) - completed;
+	
+	while (inFlight > 0)
+	{
+		struct io_uring_cqe* cqe;
+		
+		ret = io_uring_wait_cqe(m_ring.get(), &cqe);
+		if (ret == -EINTR || ret == -EAGAIN)
+			continue;
+		if (ret < 0)
+			break;
+		
+		reap(cqe);
+		inFlight--;
+	}
+	
+	std::cerr << "io_uring failed (" << strerror(-error) << "), reading without it\n";
+	
+	io_uring_queue_exit(m_ring.get());
+	m_ring.reset();
+	m_ringFailed = true;
+	
+	for (size_t i = 0; i < spans.size(); i++)
+	{
+		if (!done[i])
+			readSpan(spans[i]);
+	}
+	
+	return true;
+}
+
+#endif
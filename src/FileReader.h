@@ -2,6 +2,13 @@
 #define FILEREADER_H
 #include "Reader.h"
 #include <string>
+#include <vector>
+#include <sys/uio.h>
+#ifdef COMPILE_WITH_LIBURING
+#	include <memory>
+#	include <mutex>
+struct io_uring;
+#endif
 
 class FileReader : public Reader
 {
@@ -11,8 +18,30 @@ public:
 	
 	int32_t read(void* buf, int32_t count, uint64_t offset) override;
 	uint64_t length() override;
+	void readBatch(ReadRequest* requests, size_t count) override;
+private:
+	// Requests adjacent in the file, read with a single preadv()
+	struct Span
+	{
+		uint64_t offset;
+		std::vector<ReadRequest*> requests;
+		std::vector<struct iovec> iov;
+	};
+	
+	void readSpan(Span& span);
+	static void completeSpan(Span& span, ssize_t total);
+#ifdef COMPILE_WITH_LIBURING
+	bool readBatchRing(std::vector<Span>& spans);
+#endif
 private:
 	int m_fd;
+	uint64_t m_length;
+#ifdef COMPILE_WITH_LIBURING
+	// Created on first use, stays null if the kernel doesn't support io_uring
+	std::unique_ptr<io_uring> m_ring;
+	bool m_ringFailed;
+	std::mutex m_ringMutex;
+#endif
 };
 
 #endif
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <cstring>
 #include <set>
+#include <map>
 #include <algorithm>
 #include "HFSBTreeNode.h"
 #include "CacheZone.h"
@@ -49,12 +50,34 @@ std::vector<std::shared_ptr<HFSBTreeNode>> HFSBTree::findLeafNodes(const Key* in
 {
 	std::vector<std::shared_ptr<HFSBTreeNode>> rv;
 	std::set<uint32_t> uniqLink; // for broken filesystems
-	std::shared_ptr<HFSBTreeNode> currentPtr = findLeafNode(indexKey, comp, true);
+	std::vector<uint32_t> siblings;
+	std::map<uint32_t, std::shared_ptr<HFSBTreeNode>> batched;
+	std::shared_ptr<HFSBTreeNode> currentPtr = traverseTree(be(m_header.rootNode), indexKey, comp, true, &siblings);
 
 	if (!currentPtr)
 		return rv;
 	
 	rv.push_back(currentPtr);
+	
+	// The following leaves are known from the parent node, so read them in one batch
+	// rather than one by one while following the forward links
+	if (siblings.size() > 1)
+	{
+		const uint16_t nodeSize = currentPtr->nodeSize();
+		std::vector<std::vector<uint8_t>> data(siblings.size(), std::vector<uint8_t>(nodeSize));
+		std::vector<Reader::ReadRequest> requests;
+		
+		for (size_t i = 0; i < siblings.size(); i++)
+			requests.push_back(Reader::ReadRequest{ data[i].data(), nodeSize, uint64_t(nodeSize) * siblings[i], 0 });
+		
+		m_reader->readBatch(requests.data(), requests.size());
+		
+		for (size_t i = 0; i < siblings.size(); i++)
+		{
+			if (requests[i].result == nodeSize)
+				batched[siblings[i]] = std::make_shared<HFSBTreeNode>(std::move(data[i]), siblings[i]);
+		}
+	}
 
 	while (currentPtr->forwardLink() != 0)
 	{
@@ -69,7 +92,12 @@ std::vector<std::shared_ptr<HFSBTreeNode>> HFSBTree::findLeafNodes(const Key* in
 			uniqLink.insert(currentPtr->forwardLink());
 
 		//std::cout << "Testing node " << current.forwardLink() << std::endl;
-		currentPtr = std::make_shared<HFSBTreeNode>(m_reader, currentPtr->forwardLink(), currentPtr->nodeSize());
+		auto itBatched = batched.find(currentPtr->forwardLink());
+		
+		if (itBatched != batched.end())
+			currentPtr = itBatched->second;
+		else
+			currentPtr = std::make_shared<HFSBTreeNode>(m_reader, currentPtr->forwardLink(), currentPtr->nodeSize());
 		
 		key = currentPtr->getKey<Key>(); // TODO: or the key of the first record?
 
@@ -82,7 +110,8 @@ std::vector<std::shared_ptr<HFSBTreeNode>> HFSBTree::findLeafNodes(const Key* in
 	return rv;
 }
 
-std::shared_ptr<HFSBTreeNode> HFSBTree::traverseTree(int nodeIndex, const Key* indexKey, KeyComparator comp, bool wildcard)
+std::shared_ptr<HFSBTreeNode> HFSBTree::traverseTree(int nodeIndex, const Key* indexKey, KeyComparator comp, bool wildcard,
+		std::vector<uint32_t>* siblings)
 {
 	//std::cout << "Examining node " << nodeIndex << std::endl;
 	std::shared_ptr<HFSBTreeNode> nodePtr = std::make_shared<HFSBTreeNode>(m_reader, nodeIndex, be(m_header.nodeSize));
@@ -114,10 +143,23 @@ std::shared_ptr<HFSBTreeNode> HFSBTree::traverseTree(int nodeIndex, const Key* i
 			if (position < 0)
 				position = 0;
 			
+			if (siblings)
+			{
+				// The last index level visited overwrites this with the leaf's neighbours
+				siblings->clear();
+				
+				for (int i = position+1; i < node.recordCount() && siblings->size() < MAX_BATCHED_LEAVES; i++)
+				{
+					if (comp(node.getRecordKey<Key>(i), indexKey) > 0)
+						break;
+					siblings->push_back(be(*node.getRecordData<uint32_t>(i)));
+				}
+			}
+			
 			// recurse down
 			childIndex = node.getRecordData<uint32_t>(position);
 			
-			return traverseTree(be(*childIndex), indexKey, comp, wildcard);
+			return traverseTree(be(*childIndex), indexKey, comp, wildcard, siblings);
 		}
 		case NodeKind::kBTLeafNode:
 		{
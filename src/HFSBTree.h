@@ -37,13 +37,19 @@ public:
 	std::vector<std::shared_ptr<HFSBTreeNode>> findLeafNodes(const Key* indexKey, KeyComparator comp);
 
 protected:
-	std::shared_ptr<HFSBTreeNode> traverseTree(int nodeIndex, const Key* indexKey, KeyComparator comp, bool wildcard);
+	// If siblings is given, it receives the nodes following the found leaf whose first key may still match,
+	// as far as the leaf's parent index node tells
+	std::shared_ptr<HFSBTreeNode> traverseTree(int nodeIndex, const Key* indexKey, KeyComparator comp, bool wildcard,
+			std::vector<uint32_t>* siblings = nullptr);
 	void walkTree(int nodeIndex);
 protected:
 	std::shared_ptr<HFSFork> m_fork;
 	std::shared_ptr<Reader> m_reader;
 	//char* m_tree;
 	BTHeaderRec m_header;
+	
+	// Maximum number of sibling leaves read ahead in one batch by findLeafNodes()
+	enum { MAX_BATCHED_LEAVES = 16 };
 };
 
 #endif
@@ -14,16 +14,12 @@ public:
 	HFSBTreeNode()
 	{
 		initConveniencePointerFromBuffer();
-		#ifdef DEBUG
-			m_nodeIndex = 0;
-		#endif
+		m_nodeIndex = 0;
 	}
 	
 	HFSBTreeNode(std::shared_ptr<Reader> treeReader, uint32_t nodeIndex, uint16_t nodeSize)
 	{
-		#ifdef DEBUG
-			m_nodeIndex = nodeIndex;
-		#endif
+		m_nodeIndex = nodeIndex;
 		m_descriptorData.resize(nodeSize);
 		
 		int32_t read = treeReader->read(&m_descriptorData[0], nodeSize, nodeSize*nodeIndex);
@@ -33,6 +29,14 @@ public:
 		initConveniencePointerFromBuffer();
 	}
 	
+	// Node data read elsewhere, e.g. as part of a batch
+	HFSBTreeNode(std::vector<uint8_t>&& data, uint32_t nodeIndex)
+	: m_descriptorData(std::move(data))
+	{
+		m_nodeIndex = nodeIndex;
+		initConveniencePointerFromBuffer();
+	}
+	
 	HFSBTreeNode(const HFSBTreeNode& that)
 	{
 		*this = that; // calling assgnment op below
@@ -40,9 +44,7 @@ public:
 	
 	HFSBTreeNode& operator=(const HFSBTreeNode& that)
 	{
-		#ifdef DEBUG
-			m_nodeIndex = that.m_nodeIndex;
-		#endif
+		m_nodeIndex = that.m_nodeIndex;
 		m_descriptorData = that.m_descriptorData;
 		initConveniencePointerFromBuffer();
 		return *this;
@@ -63,6 +65,11 @@ public:
 		return m_descriptor;
 	}
 	
+	uint32_t nodeIndex() const
+	{
+		return m_nodeIndex;
+	}
+	
 	uint16_t nodeSize() const
 	{
 		return m_descriptorData.size();
@@ -203,9 +210,7 @@ private:
 	// convenience initialised by initConveniencePointerFromBuffer()
 	mutable BTNodeDescriptor* m_descriptor;
 	uint16_t* m_firstRecordOffset;
-	#ifdef DEBUG
-		uint32_t m_nodeIndex;
-	#endif
+	uint32_t m_nodeIndex;
 };
 
 #endif
@@ -5,6 +5,7 @@
 #include "unichar.h"
 #include <sstream>
 #include <cstring>
+#include <set>
 using icu::UnicodeString;
 static const int MAX_SYMLINKS = 50;
 
@@ -13,10 +14,10 @@ extern UConverter *g_utf16be;
 HFSCatalogBTree::HFSCatalogBTree(std::shared_ptr<HFSFork> fork, HFSVolume* volume, CacheZone* zone)
 	: HFSBTree(fork, zone, "Catalog"), m_volume(volume), m_hardLinkDirID(0)
 {
-	HFSPlusCatalogFileOrFolder ff;
-	int rv = stat(std::string("\0\0\0\0HFS+ Private Data", 21), &ff);
+	HFSCatalogRecord rec;
+	int rv = stat(std::string("\0\0\0\0HFS+ Private Data", 21), &rec);
 	if (rv == 0)
-		m_hardLinkDirID = be(ff.folder.folderID);
+		m_hardLinkDirID = rec.cnid;
 }
 
 bool HFSCatalogBTree::isCaseSensitive() const
@@ -119,50 +120,113 @@ int HFSCatalogBTree::idOnlyComparator(const Key* indexKey, const Key* desiredKey
 		return 0;
 }
 
-int HFSCatalogBTree::listDirectory(const std::string& path, std::map<std::string, std::shared_ptr<HFSPlusCatalogFileOrFolder>>& contents)
+int HFSCatalogBTree::listDirectory(const std::string& path, std::map<std::string, HFSCatalogRecord>& contents)
 {
-	HFSPlusCatalogFileOrFolder dir;
+	contents.clear();
+
+	return listDirectory(path, 0, [&](const std::string& name, const HFSCatalogRecord& rec, uint64_t) {
+		contents[name] = rec;
+		return true;
+	});
+}
+
+// Directory cookies address the next record to be returned: the leaf node index in the upper bits,
+// the record index within that node in the lower 16 bits. Node 0 is the header node, so a valid cookie is never 0.
+static inline uint64_t makeDirectoryCookie(uint32_t nodeIndex, uint16_t recordIndex)
+{
+	return (uint64_t(nodeIndex) << 16) | recordIndex;
+}
+
+int HFSCatalogBTree::listDirectory(const std::string& path, uint64_t cookie, const DirectoryVisitor& visitor)
+{
+	HFSCatalogRecord dir;
 	int rv;
-	std::vector<std::shared_ptr<HFSBTreeNode>> leaves;
 	HFSPlusCatalogKey key;
-	std::map<std::string, std::shared_ptr<HFSPlusCatalogFileOrFolder>> beContents;
-
-	contents.clear();
+	std::shared_ptr<HFSBTreeNode> leafPtr;
+	std::set<uint32_t> uniqLink; // for broken filesystems
+	int recordIndex = 0;
+	HFSCatalogNodeID cnid;
 
 	// determine the CNID of the directory
 	rv = stat(path, &dir);
 	if (rv != 0)
 		return rv;
 
-	if (be(dir.folder.recordType) != RecordType::kHFSPlusFolderRecord)
+	if (dir.recordType != RecordType::kHFSPlusFolderRecord)
 		return -ENOTDIR;
 
-	// find leaves that may contain directory elements
-	key.parentID = dir.folder.folderID;
-	leaves = findLeafNodes((Key*) &key, idOnlyComparator);
+	cnid = dir.cnid;
 
-	for (std::shared_ptr<HFSBTreeNode> leafPtr : leaves)
+	if (cookie == 0)
 	{
-		//std::cerr << "**** Looking for elems with CNID " << be(key.parentID) << std::endl;
-		 appendNameAndHFSPlusCatalogFileOrFolderFromLeafForParentId(leafPtr, be(key.parentID), beContents);
+		// find the leaf where elements of this directory start
+		key.parentID = htobe32(cnid);
+		leafPtr = findLeafNode((Key*) &key, idOnlyComparator, true);
+	}
+	else
+	{
+		if ((cookie >> 16) > UINT32_MAX)
+			return -EINVAL;
+
+		leafPtr = std::make_shared<HFSBTreeNode>(m_reader, uint32_t(cookie >> 16), be(m_header.nodeSize));
+		recordIndex = cookie & 0xffff;
+
+		if (leafPtr->kind() != NodeKind::kBTLeafNode)
+			return -EINVAL;
 	}
 
-	for (auto it = beContents.begin(); it != beContents.end(); it++)
+	while (leafPtr)
 	{
-		std::string filename = it->first;
-
-		/* Filter out :
-		 * - "\0\0\0\0HFS+ Private Data" (truth is, every filename whose first char is \0 will be filtered out)
-		 * - ".HFS+ Private Directory Data\r"
-		 * - ".journal"
-		 * - ".journal_info_block"
-		 * from root directory
-		 */
-		if (be(dir.folder.folderID) != kHFSRootFolderID  ||  (filename[0]!=0  &&  filename.compare(".HFS+ Private Directory Data\r")!=0  &&  filename.compare(".journal")!=0  &&  filename.compare(".journal_info_block")!=0))
+		for (; recordIndex < leafPtr->recordCount(); recordIndex++)
 		{
+			HFSPlusCatalogKey* recordKey = leafPtr->getRecordKey<HFSPlusCatalogKey>(recordIndex);
+			HFSPlusCatalogFileOrFolder* ff;
+			RecordType recType;
+			HFSCatalogRecord rec;
+			std::string filename;
+
+			if (be(recordKey->parentID) < cnid)
+				continue;
+			if (be(recordKey->parentID) > cnid)
+				return 0; // past the last element of this directory
+
+			ff = leafPtr->getRecordData<HFSPlusCatalogFileOrFolder>(recordIndex);
+			recType = be(ff->folder.recordType);
+
+			if (recType != RecordType::kHFSPlusFolderRecord && recType != RecordType::kHFSPlusFileRecord)
+				continue;
+
+			filename = UnicharToString(recordKey->nodeName);
+
+			/* Filter out :
+			 * - "\0\0\0\0HFS+ Private Data" (truth is, every filename whose first char is \0 will be filtered out)
+			 * - ".HFS+ Private Directory Data\r"
+			 * - ".journal"
+			 * - ".journal_info_block"
+			 * from root directory
+			 */
+			if (cnid == kHFSRootFolderID && (filename[0] == 0 || filename.compare(".HFS+ Private Directory Data\r") == 0
+					|| filename.compare(".journal") == 0 || filename.compare(".journal_info_block") == 0))
+				continue;
+
 			replaceChars(filename, '/', ':'); // Issue #36: / and : have swapped meaning in HFS+
-			contents[filename] = it->second;
+			decodeRecord(*ff, &rec);
+
+			if (!visitor(filename, rec, makeDirectoryCookie(leafPtr->nodeIndex(), recordIndex+1)))
+				return 0;
 		}
+
+		if (leafPtr->forwardLink() == 0)
+			break;
+
+		if (!uniqLink.insert(leafPtr->forwardLink()).second)
+		{
+			std::cerr << "WARNING: forward link loop detected!\n";
+			break;
+		}
+
+		leafPtr = std::make_shared<HFSBTreeNode>(m_reader, leafPtr->forwardLink(), be(m_header.nodeSize));
+		recordIndex = 0;
 	}
 
 	return 0;
@@ -177,33 +241,40 @@ static void split(const std::string &s, char delim, std::vector<std::string>& el
 		elems.push_back(item);
 }
 
-std::shared_ptr<HFSPlusCatalogFileOrFolder> HFSCatalogBTree::findHFSPlusCatalogFileOrFolderForParentIdAndName(HFSCatalogNodeID parentID, const std::string &elem)
+bool HFSCatalogBTree::findCatalogRecordForParentIdAndName(HFSCatalogNodeID parentID, const std::string &elem, HFSCatalogRecord* rec, HFSPlusCatalogFileOrFolder* raw)
 {
 	HFSPlusCatalogKey key;
 	key.parentID = htobe32(parentID);
 	std::vector<std::shared_ptr<HFSBTreeNode>> leaves;
+	int found = 0;
+
 	leaves = findLeafNodes((Key*) &key, idOnlyComparator);
-	std::map<std::string, std::shared_ptr<HFSPlusCatalogFileOrFolder>> beContents;
 	for (std::shared_ptr<HFSBTreeNode> leafPtr : leaves)
 	{
 		//std::cerr << "**** Looking for elems with CNID " << be(key.parentID) << std::endl;
-		appendNameAndHFSPlusCatalogFileOrFolderFromLeafForParentIdAndName(leafPtr, be(key.parentID), elem, beContents);
+		found += findRecordsInLeafForParentIdAndName(*leafPtr, parentID, elem, rec, raw);
 	}
-	if (beContents.size() == 0)
-		return nullptr;
-	if (beContents.size() > 1)
+	if (found > 1)
 		throw io_error("Multiple records with same name");
 	
-	return beContents.begin()->second;
+	return found != 0;
 }
 
 int HFSCatalogBTree::stat(std::string path, HFSPlusCatalogFileOrFolder* s)
+{
+	HFSCatalogRecord rec;
+
+	return stat(path, &rec, s);
+}
+
+int HFSCatalogBTree::stat(std::string path, HFSCatalogRecord* rec, HFSPlusCatalogFileOrFolder* raw)
 {
 	std::vector<std::string> elems;
-	std::shared_ptr<HFSBTreeNode> leafNodePtr;
-	std::shared_ptr<HFSPlusCatalogFileOrFolder> last = nullptr;
+	bool found = false;
 
-	memset(s, 0, sizeof(*s));
+	memset(rec, 0, sizeof(*rec));
+	if (raw)
+		memset(raw, 0, sizeof(*raw));
 
 	if (path.compare(0, 1, "/") == 0)
 		path = path.substr(1);
@@ -218,13 +289,14 @@ int HFSCatalogBTree::stat(std::string path, HFSPlusCatalogFileOrFolder* s)
 		std::string elem = elems[i];
 		replaceChars(elem, ':', '/'); // Issue #36: / and : have swapped meaning in HFS+
 
-		HFSCatalogNodeID parentID = last ? be(last->folder.folderID) : kHFSRootParentID;
+		HFSCatalogNodeID parentID = found ? rec->cnid : kHFSRootParentID;
 
 		//if (ustr.length() > 255) // FIXME: there is a UCS-2 vs UTF-16 issue here!
 		//	return -ENAMETOOLONG;
 
-		last = findHFSPlusCatalogFileOrFolderForParentIdAndName(parentID, elem);
-		if (last==nullptr)
+		// only the last element needs the full on-disk record
+		found = findCatalogRecordForParentIdAndName(parentID, elem, rec, (i+1 == elems.size()) ? raw : nullptr);
+		if (!found)
 			return -ENOENT;
 
 		// resolve symlinks, check if directory...
@@ -251,37 +323,39 @@ int HFSCatalogBTree::stat(std::string path, HFSPlusCatalogFileOrFolder* s)
 
 		//parent = last->folder.folderID;
 	}
-	if (be(last->file.userInfo.fileType) == kHardLinkFileType  &&  m_hardLinkDirID != 0) {
+	if (rec->fileType == kHardLinkFileType  &&  m_hardLinkDirID != 0) {
 		std::string iNodePath;
+		HFSCatalogRecord iNodeRec;
+		HFSPlusCatalogFileOrFolder iNodeRaw;
+
 		iNodePath += "iNode";
-		iNodePath += std::to_string(be(last->file.permissions.special.iNodeNum));
-		std::shared_ptr<HFSPlusCatalogFileOrFolder> leafNodeHl = findHFSPlusCatalogFileOrFolderForParentIdAndName(m_hardLinkDirID, iNodePath);
-		if (leafNodeHl!=nullptr)
-			last = leafNodeHl;
+		iNodePath += std::to_string(rec->special);
+		if (findCatalogRecordForParentIdAndName(m_hardLinkDirID, iNodePath, &iNodeRec, raw ? &iNodeRaw : nullptr))
+		{
+			*rec = iNodeRec;
+			if (raw)
+				*raw = iNodeRaw;
+		}
 	}
-	*s = *last;
 	
-	//std::cout << "File/folder flags: 0x" << std::hex << s->file.flags << std::endl;
+	//std::cout << "File/folder flags: 0x" << std::hex << raw->file.flags << std::endl;
 
 	return 0;
 }
 extern int mustbreak;
 
-void HFSCatalogBTree::appendNameAndHFSPlusCatalogFileOrFolderFromLeafForParentId(std::shared_ptr<HFSBTreeNode> leafNodePtr, HFSCatalogNodeID cnid, std::map<std::string, std::shared_ptr<HFSPlusCatalogFileOrFolder>>& map)
+int HFSCatalogBTree::findRecordsInLeafForParentIdAndName(const HFSBTreeNode& leafNode, HFSCatalogNodeID cnid, const std::string& name, HFSCatalogRecord* rec, HFSPlusCatalogFileOrFolder* raw)
 {
-	appendNameAndHFSPlusCatalogFileOrFolderFromLeafForParentIdAndName(leafNodePtr, cnid, "", map);
-}
+	int found = 0;
 
-void HFSCatalogBTree::appendNameAndHFSPlusCatalogFileOrFolderFromLeafForParentIdAndName(std::shared_ptr<HFSBTreeNode> leafNodePtr, HFSCatalogNodeID cnid, const std::string& name, std::map<std::string, std::shared_ptr<HFSPlusCatalogFileOrFolder>>& map)
-{
-	for (int i = 0; i < leafNodePtr->recordCount(); i++)
+	for (int i = 0; i < leafNode.recordCount(); i++)
 	{
 		HFSPlusCatalogKey* recordKey;
 		HFSPlusCatalogFileOrFolder* ff;
 		RecordType recType;
 
-		recordKey = leafNodePtr->getRecordKey<HFSPlusCatalogKey>(i);
-		ff = leafNodePtr->getRecordData<HFSPlusCatalogFileOrFolder>(i);
+		recordKey = leafNode.getRecordKey<HFSPlusCatalogKey>(i);
+		ff = leafNode.getRecordData<HFSPlusCatalogFileOrFolder>(i);
 
 		recType = be(ff->folder.recordType);
 		//{
@@ -309,8 +383,11 @@ void HFSCatalogBTree::appendNameAndHFSPlusCatalogFileOrFolderFromLeafForParentId
 
 					if (equal)
 					{
-						std::string name = UnicharToString(recordKey->nodeName);
-						map[name] = std::shared_ptr<HFSPlusCatalogFileOrFolder>(leafNodePtr, ff); // retain leafPtr, act as a HFSPlusCatalogFileOrFolder
+						// copy out the few fields we need, the leaf node itself is not retained
+						decodeRecord(*ff, rec);
+						if (raw)
+							*raw = *ff;
+						found++;
 					}
 				}
 				//else
@@ -322,6 +399,38 @@ void HFSCatalogBTree::appendNameAndHFSPlusCatalogFileOrFolderFromLeafForParentId
 				break;
 		}
 	}
+
+	return found;
+}
+
+void HFSCatalogBTree::decodeRecord(const HFSPlusCatalogFileOrFolder& ff, HFSCatalogRecord* rec)
+{
+	// Files and folders share the layout of the fields up to (and including) permissions
+	rec->recordType = be(ff.file.recordType);
+	rec->cnid = be(ff.file.fileID);
+	rec->createDate = be(ff.file.createDate);
+	rec->contentModDate = be(ff.file.contentModDate);
+	rec->attributeModDate = be(ff.file.attributeModDate);
+	rec->accessDate = be(ff.file.accessDate);
+	rec->ownerID = be(ff.file.permissions.ownerID);
+	rec->groupID = be(ff.file.permissions.groupID);
+	rec->ownerFlags = ff.file.permissions.ownerFlags;
+	rec->fileMode = be(ff.file.permissions.fileMode);
+	rec->special = be(ff.file.permissions.special.iNodeNum);
+
+	if (rec->recordType == RecordType::kHFSPlusFileRecord)
+	{
+		rec->fileType = be(ff.file.userInfo.fileType);
+		rec->fileCreator = be(ff.file.userInfo.fileCreator);
+		rec->dataFork = ff.file.dataFork;
+		rec->resourceFork = ff.file.resourceFork;
+	}
+	else
+	{
+		rec->fileType = rec->fileCreator = 0;
+		memset(&rec->dataFork, 0, sizeof(rec->dataFork));
+		memset(&rec->resourceFork, 0, sizeof(rec->resourceFork));
+	}
 }
 
 time_t HFSCatalogBTree::appleToUnixTime(uint32_t apple)
@@ -337,20 +446,20 @@ time_t HFSCatalogBTree::appleToUnixTime(uint32_t apple)
 
 int HFSCatalogBTree::openFile(const std::string& path, std::shared_ptr<Reader>& forkOut, bool resourceFork)
 {
-	HFSPlusCatalogFileOrFolder ff;
+	HFSCatalogRecord rec;
 	int rv;
 
 	forkOut.reset();
 
-	rv = stat(path, &ff);
+	rv = stat(path, &rec);
 	if (rv < 0)
 		return rv;
 
-	if (be(ff.folder.recordType) != RecordType::kHFSPlusFileRecord)
+	if (rec.recordType != RecordType::kHFSPlusFileRecord)
 		return -EISDIR;
 
-	forkOut.reset(new HFSFork(m_volume, resourceFork ? ff.file.resourceFork : ff.file.dataFork,
-		be(ff.file.fileID), resourceFork));
+	forkOut.reset(new HFSFork(m_volume, resourceFork ? rec.resourceFork : rec.dataFork,
+		rec.cnid, resourceFork));
 
 	return 0;
 }
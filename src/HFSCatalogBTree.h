@@ -9,6 +9,24 @@
 #include "HFSBTreeNode.h"
 #include "CacheZone.h"
 #include <memory>
+#include <functional>
+
+// Host-endian subset of a catalog file or folder record, decoded once when a leaf is scanned.
+// Unlike a pointer into the leaf, holding on to it does not keep the whole B-tree node alive.
+struct HFSCatalogRecord
+{
+	RecordType recordType;
+	HFSCatalogNodeID cnid; // fileID or folderID
+	uint32_t createDate, contentModDate, attributeModDate, accessDate;
+	uint32_t ownerID, groupID;
+	uint8_t ownerFlags;
+	uint16_t fileMode;
+	uint32_t special; // iNodeNum, linkCount or rawDevice
+	uint32_t fileType, fileCreator; // 0 for folders
+
+	// Kept in on-disk (big endian) layout, as consumed by HFSFork. Zeroed for folders.
+	HFSPlusForkData dataFork, resourceFork;
+};
 
 class HFSCatalogBTree : protected HFSBTree
 {
@@ -16,11 +34,20 @@ public:
 	// using HFSBTree::HFSBTree;
 	HFSCatalogBTree(std::shared_ptr<HFSFork> fork, HFSVolume* volume, CacheZone* zone);
 
-	int listDirectory(const std::string& path, std::map<std::string, std::shared_ptr<HFSPlusCatalogFileOrFolder>>& contents);
-	
-	std::shared_ptr<HFSPlusCatalogFileOrFolder> findHFSPlusCatalogFileOrFolderForParentIdAndName(HFSCatalogNodeID parentID, const std::string &elem);
+	int listDirectory(const std::string& path, std::map<std::string, HFSCatalogRecord>& contents);
+
+	// Called for every directory entry in on-disk order. nextCookie resumes the listing right after this entry.
+	// Return false to stop the enumeration.
+	typedef std::function<bool(const std::string& name, const HFSCatalogRecord& rec, uint64_t nextCookie)> DirectoryVisitor;
 
+	// Streams directory contents starting at the given cookie (0 = first entry) without materializing the listing
+	int listDirectory(const std::string& path, uint64_t cookie, const DirectoryVisitor& visitor);
+	
+	// Returns false if there is no such element. raw (optional) receives a copy of the on-disk record.
+	bool findCatalogRecordForParentIdAndName(HFSCatalogNodeID parentID, const std::string &elem, HFSCatalogRecord* rec, HFSPlusCatalogFileOrFolder* raw = nullptr);
 
+	// Hard links are resolved to their iNode record
+	int stat(std::string path, HFSCatalogRecord* rec, HFSPlusCatalogFileOrFolder* raw = nullptr);
 	int stat(std::string path, HFSPlusCatalogFileOrFolder* s);
 	int openFile(const std::string& path, std::shared_ptr<Reader>& forkOut, bool resourceFork = false);
 
@@ -34,13 +61,12 @@ protected:
 	std::string readSymlink(HFSPlusCatalogFile* file);
 
 private:
-	void appendNameAndHFSPlusCatalogFileOrFolderFromLeafForParentId(std::shared_ptr<HFSBTreeNode> leafNodePtr, HFSCatalogNodeID cnid, std::map<std::string, std::shared_ptr<HFSPlusCatalogFileOrFolder>>& map);
-	void appendNameAndHFSPlusCatalogFileOrFolderFromLeafForParentIdAndName(std::shared_ptr<HFSBTreeNode> leafNodePtr, HFSCatalogNodeID cnid, const std::string& name, std::map<std::string, std::shared_ptr<HFSPlusCatalogFileOrFolder>>& map);
+	int findRecordsInLeafForParentIdAndName(const HFSBTreeNode& leafNode, HFSCatalogNodeID cnid, const std::string& name, HFSCatalogRecord* rec, HFSPlusCatalogFileOrFolder* raw);
 
 static int caseInsensitiveComparator(const Key* indexKey, const Key* desiredKey);
 	static int caseSensitiveComparator(const Key* indexKey, const Key* desiredKey);
 	static int idOnlyComparator(const Key* indexKey, const Key* desiredKey);
-	static void fixEndian(HFSPlusCatalogFileOrFolder& ff);
+	static void decodeRecord(const HFSPlusCatalogFileOrFolder& ff, HFSCatalogRecord* rec);
 	static void replaceChars(std::string& str, char oldChar, char newChar);
 	
 	void dumpTree(int nodeIndex, int depth) const;
@@ -18,6 +18,11 @@ HFSFork::HFSFork(HFSVolume* vol, const HFSPlusForkData& fork, HFSCatalogNodeID c
 	}
 }
 
+bool HFSFork::isCaching()
+{
+	return m_volume->m_reader->isCaching();
+}
+
 uint64_t HFSFork::length()
 {
 	return be(m_fork.logicalSize);
@@ -40,13 +45,13 @@ void HFSFork::loadFromOverflowsFile(uint32_t blocksSoFar)
 		throw io_error("Overflow extents not found for given CNID");
 }
 
-int32_t HFSFork::read(void* buf, int32_t count, uint64_t offset)
+void HFSFork::mapRange(void* buf, int32_t count, uint64_t offset, std::vector<ReadRequest>& pieces)
 {
 	const auto blockSize = be(m_volume->m_header.blockSize);
 	const uint32_t firstBlock = offset / blockSize;
 	uint32_t blocksSoFar;
 	int firstExtent, extent;
-	uint32_t read = 0;
+	uint32_t queued = 0;
 	uint64_t offsetInExtent;
 	
 	if (offset > be(m_fork.logicalSize))
@@ -54,8 +59,8 @@ int32_t HFSFork::read(void* buf, int32_t count, uint64_t offset)
 	else if (offset+count > be(m_fork.logicalSize))
 		count = be(m_fork.logicalSize) - offset;
 	
-	if (!count)
-		return 0;
+	if (count <= 0)
+		return;
 	
 	firstExtent = -1;
 	blocksSoFar = 0;
@@ -84,46 +89,92 @@ int32_t HFSFork::read(void* buf, int32_t count, uint64_t offset)
 
 	} while(firstExtent == -1);
 	
-	// start reading blocks
+	// collect the extent pieces
 	extent = firstExtent;
-	while (read < count && read+offset < length())
+	while (queued < count && queued+offset < length())
 	{
 		int32_t thistime;
-		int32_t reallyRead;
 		uint64_t volumeOffset;
 
 		if (extent >= m_extents.size())
 			loadFromOverflowsFile(blocksSoFar);
 		
-		thistime = std::min<int64_t>(m_extents[extent].blockCount * uint64_t(blockSize) - offsetInExtent, count-read);
+		thistime = std::min<int64_t>(m_extents[extent].blockCount * uint64_t(blockSize) - offsetInExtent, count-queued);
 		
 		if (thistime == 0)
 			throw std::logic_error("Internal error: thistime == 0");
 		
-		//std::cout << "Remaining to read: " << count-read << std::endl;
+		//std::cout << "Remaining to read: " << count-queued << std::endl;
 		//std::cout << "Extent " << extent << " has " << m_extents[extent].blockCount << " blocks\n";
 		//std::cout << "This extent holds " << m_extents[extent].blockCount * uint64_t(blockSize) << " bytes\n";	
 		//std::cout << "Reading " << thistime << " from block: " << startBlock << ", block size: " << blockSize <<  std::endl;
 		volumeOffset = m_extents[extent].startBlock * uint64_t(blockSize) + offsetInExtent;
 		
-		reallyRead = m_volume->m_reader->read((char*)buf + read, thistime, volumeOffset);
-		assert(reallyRead <= thistime);
-		
-		read += reallyRead;
-		
-		if (reallyRead != thistime)
-		{
-			//std::cerr << "Short read: " << thistime << " expected, " << reallyRead << " received\n";
-			break;
-		}
+		pieces.push_back(ReadRequest{ (char*)buf + queued, thistime, volumeOffset, 0 });
+		queued += thistime;
 		
 		blocksSoFar += m_extents[extent].blockCount;
 		//std::cout << "Blocks so far: " << blocksSoFar << std::endl;
 		extent++;
 		offsetInExtent = 0;
 	}
+}
+
+int32_t HFSFork::collectResults(const ReadRequest* pieces, size_t count)
+{
+	int32_t read = 0;
+	
+	for (size_t i = 0; i < count; i++)
+	{
+		if (pieces[i].result <= 0)
+			break;
+		
+		assert(pieces[i].result <= pieces[i].count);
+		read += pieces[i].result;
+		
+		if (pieces[i].result != pieces[i].count)
+		{
+			//std::cerr << "Short read: " << pieces[i].count << " expected, " << pieces[i].result << " received\n";
+			break;
+		}
+	}
+	
+	return read;
+}
+
+int32_t HFSFork::read(void* buf, int32_t count, uint64_t offset)
+{
+	std::vector<ReadRequest> pieces;
+	int32_t read;
+	
+	// the extents are read in a single batch
+	mapRange(buf, count, offset, pieces);
+	if (pieces.empty())
+		return 0;
+	
+	m_volume->m_reader->readBatch(pieces.data(), pieces.size());
+	read = collectResults(pieces.data(), pieces.size());
 	
 	assert(read <= count);
 	
 	return read;
 }
+
+void HFSFork::readBatch(ReadRequest* requests, size_t count)
+{
+	std::vector<ReadRequest> pieces;
+	std::vector<size_t> firstPiece;
+	
+	// All extent pieces of all requests go down as one batch
+	for (size_t i = 0; i < count; i++)
+	{
+		firstPiece.push_back(pieces.size());
+		mapRange(requests[i].buf, requests[i].count, requests[i].offset, pieces);
+	}
+	firstPiece.push_back(pieces.size());
+	
+	m_volume->m_reader->readBatch(pieces.data(), pieces.size());
+	
+	for (size_t i = 0; i < count; i++)
+		requests[i].result = collectResults(&pieces[firstPiece[i]], firstPiece[i+1] - firstPiece[i]);
+}
@@ -13,8 +13,15 @@ public:
 	HFSFork(HFSVolume* vol, const HFSPlusForkData& fork, HFSCatalogNodeID cnid = kHFSNullID, bool resourceFork = false);
 	int32_t read(void* buf, int32_t count, uint64_t offset) override;
 	uint64_t length() override;
+	void readBatch(ReadRequest* requests, size_t count) override;
+	// A fork is a plain slice of the volume, so it is cached whenever the volume is
+	bool isCaching() override;
 private:
 	void loadFromOverflowsFile(uint32_t blocksSoFar);
+	// Appends the volume reads making up the given range of the fork
+	void mapRange(void* buf, int32_t count, uint64_t offset, std::vector<ReadRequest>& pieces);
+	// Sums up the results of pieces read for a single range, up to the first short read
+	static int32_t collectResults(const ReadRequest* pieces, size_t count);
 private:
 	HFSVolume* m_volume;
 	HFSPlusForkData m_fork;
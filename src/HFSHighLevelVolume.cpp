@@ -2,7 +2,10 @@
 #include <stdint.h>
 #include <cstring>
 #include "HFSAttributeBTree.h"
+#include "HFSFork.h"
 #include "HFSZlibReader.h"
+#include "HFSLZVNReader.h"
+#include "HFSLZFSEReader.h"
 #include "MemoryReader.h"
 #include "ResourceFork.h"
 #include "exceptions.h"
@@ -20,8 +23,8 @@ HFSHighLevelVolume::HFSHighLevelVolume(std::shared_ptr<HFSVolume> volume)
 	if (volumeSize < 50*1024*1024)
 	{
 		// limit cache sizes to volume size
-		m_volume->getFileZone()->setMaxBlocks(volumeSize / CacheZone::BLOCK_SIZE / 2);
-		m_volume->getBtreeZone()->setMaxBlocks(volumeSize / CacheZone::BLOCK_SIZE / 2);
+		m_volume->getFileZone()->setMaxBlocks(volumeSize / m_volume->getFileZone()->blockSize() / 2 + 1);
+		m_volume->getBtreeZone()->setMaxBlocks(volumeSize / m_volume->getBtreeZone()->blockSize() / 2 + 1);
 	}
 
 	m_tree.reset(m_volume->rootCatalogTree());
@@ -37,29 +40,34 @@ static bool string_endsWith(const std::string& str, const std::string& what)
 
 std::map<std::string, struct stat> HFSHighLevelVolume::listDirectory(const std::string& path)
 {
-	std::map<std::string, std::shared_ptr<HFSPlusCatalogFileOrFolder>> contents;
 	std::map<std::string, struct stat> rv;
-	int err;
 
-	err = m_tree->listDirectory(path, contents);
+	listDirectory(path, 0, [&](const std::string& name, const struct stat& st, uint64_t) {
+		rv[name] = st;
+		return true;
+	});
 
-	if (err != 0)
-		throw file_not_found_error(path);
+	return rv;
+}
 
-	for (auto it = contents.begin(); it != contents.end(); it++)
-	{
+void HFSHighLevelVolume::listDirectory(const std::string& path, uint64_t cookie, const DirectoryVisitor& visitor)
+{
+	int err;
+
+	err = m_tree->listDirectory(path, cookie, [&](const std::string& name, const HFSCatalogRecord& rec, uint64_t nextCookie) {
 		struct stat st;
-		hfs_nativeToStat_decmpfs(*(it->second), &st, string_endsWith(it->first, RESOURCE_FORK_SUFFIX));
+		hfs_nativeToStat_decmpfs(rec, &st, string_endsWith(name, RESOURCE_FORK_SUFFIX));
 
-		rv[it->first] = st;
-	}
+		return visitor(name, st, nextCookie);
+	});
 
-	return rv;
+	if (err != 0)
+		throw file_not_found_error(path);
 }
 
 struct stat HFSHighLevelVolume::stat(const std::string& path)
 {
-	HFSPlusCatalogFileOrFolder ff;
+	HFSCatalogRecord rec;
 	std::string spath = path;
 	int rv;
 	bool resourceFork = false;
@@ -71,28 +79,28 @@ struct stat HFSHighLevelVolume::stat(const std::string& path)
 		resourceFork = true;
 	}
 
-	rv = m_tree->stat(spath.c_str(), &ff);
+	rv = m_tree->stat(spath.c_str(), &rec);
 	if (rv != 0)
 		throw file_not_found_error(spath);
 
-	hfs_nativeToStat_decmpfs(ff, &stat, resourceFork);
+	hfs_nativeToStat_decmpfs(rec, &stat, resourceFork);
 
 	return stat;
 }
 
-void HFSHighLevelVolume::hfs_nativeToStat_decmpfs(const HFSPlusCatalogFileOrFolder& ff, struct stat* stat, bool resourceFork)
+void HFSHighLevelVolume::hfs_nativeToStat_decmpfs(const HFSCatalogRecord& rec, struct stat* stat, bool resourceFork)
 {
 	assert(stat != nullptr);
 
-	hfs_nativeToStat(ff, stat, resourceFork);
+	hfs_nativeToStat(rec, stat, resourceFork);
 
 	// Compressed FS support
-	if ((ff.file.permissions.ownerFlags & HFS_PERM_OFLAG_COMPRESSED) && !stat->st_size)
+	if ((rec.ownerFlags & HFS_PERM_OFLAG_COMPRESSED) && !stat->st_size)
 	{
 		decmpfs_disk_header* hdr;
 		std::vector<uint8_t> xattrData;
 
-		hdr = get_decmpfs(be(ff.file.fileID), xattrData);
+		hdr = get_decmpfs(rec.cnid, xattrData);
 
 		if (hdr != nullptr)
 			stat->st_size = hdr->uncompressed_size;
@@ -100,12 +108,101 @@ void HFSHighLevelVolume::hfs_nativeToStat_decmpfs(const HFSPlusCatalogFileOrFold
 }
 
 std::shared_ptr<Reader> HFSHighLevelVolume::openFile(const std::string& path)
+{
+	Clock::time_point now = Clock::now();
+	auto itPath = m_openFilePaths.find(path);
+	std::shared_ptr<Reader> file;
+	uint64_t key;
+
+	if (itPath != m_openFilePaths.end())
+	{
+		OpenFile& of = m_openFiles[itPath->second];
+
+		of.lastUsed = now;
+		file = handleFor(of.paths.front(), of.reader);
+		pruneOpenFiles(false);
+		return file;
+	}
+
+	file = openFileUncached(path, key);
+
+	// Another path (hardlink) may already lead to the same file
+	auto itFile = m_openFiles.find(key);
+	if (itFile == m_openFiles.end())
+	{
+		pruneOpenFiles(m_openFiles.size() >= OPEN_FILE_MAX);
+		itFile = m_openFiles.insert(std::make_pair(key, OpenFile())).first;
+		itFile->second.reader = file;
+	}
+
+	itFile->second.paths.push_back(path);
+	itFile->second.lastUsed = now;
+	m_openFilePaths[path] = key;
+
+	return handleFor(itFile->second.paths.front(), itFile->second.reader);
+}
+
+void HFSHighLevelVolume::closeFile()
+{
+	// Files that are opened again and again never get to insert a new entry
+	pruneOpenFiles(false);
+}
+
+std::shared_ptr<Reader> HFSHighLevelVolume::handleFor(const std::string& path, const std::shared_ptr<Reader>& file)
+{
+	// Forks of a DMG partition are already cached decompressed in the DMG's zone
+	if (file->isCaching())
+		return file;
+
+	// Handles of a file share cached data through the tag, but each detects sequential reads by itself
+	return std::make_shared<CachedReader>(file, m_volume->getFileZone(), path);
+}
+
+void HFSHighLevelVolume::pruneOpenFiles(bool force)
+{
+	Clock::time_point now = Clock::now();
+
+	if (!force && now - m_lastPrune < std::chrono::seconds(1))
+		return;
+	m_lastPrune = now;
+
+	auto it = m_openFiles.begin();
+	auto oldest = m_openFiles.end();
+
+	while (it != m_openFiles.end())
+	{
+		// Files still held by an open handle are never dropped
+		bool inUse = it->second.reader.use_count() > 1;
+
+		if (!inUse && now - it->second.lastUsed >= std::chrono::seconds(OPEN_FILE_IDLE_SECONDS))
+		{
+			for (const std::string& p : it->second.paths)
+				m_openFilePaths.erase(p);
+			it = m_openFiles.erase(it);
+			continue;
+		}
+
+		if (!inUse && (oldest == m_openFiles.end() || it->second.lastUsed < oldest->second.lastUsed))
+			oldest = it;
+		++it;
+	}
+
+	// Make room for one more entry if still at the limit
+	if (m_openFiles.size() >= OPEN_FILE_MAX && oldest != m_openFiles.end())
+	{
+		for (const std::string& p : oldest->second.paths)
+			m_openFilePaths.erase(p);
+		m_openFiles.erase(oldest);
+	}
+}
+
+std::shared_ptr<Reader> HFSHighLevelVolume::openFileUncached(const std::string& path, uint64_t& key)
 {
 	std::shared_ptr<Reader> file;
 	std::string spath = path;
 	int rv = 0;
 	bool resourceFork = false, compressed = false;
-	HFSPlusCatalogFileOrFolder ff;
+	HFSCatalogRecord rec;
 
 	if (string_endsWith(path, RESOURCE_FORK_SUFFIX))
 	{
@@ -113,29 +210,26 @@ std::shared_ptr<Reader> HFSHighLevelVolume::openFile(const std::string& path)
 		resourceFork = true;
 	}
 
+	rv = m_tree->stat(spath.c_str(), &rec);
+	if (rv != 0 || rec.recordType != RecordType::kHFSPlusFileRecord)
+		throw file_not_found_error(path);
+
 	if (!resourceFork)
-	{
-		// stat
-		rv = m_tree->stat(spath.c_str(), &ff);
-		compressed = ff.file.permissions.ownerFlags & HFS_PERM_OFLAG_COMPRESSED;
-	}
+		compressed = rec.ownerFlags & HFS_PERM_OFLAG_COMPRESSED;
 
-	if (rv != 0)
-		throw file_not_found_error(path);
+	key = (uint64_t(rec.cnid) << 1) | (resourceFork ? 1 : 0);
 
 	if (!compressed)
 	{
-		rv = m_tree->openFile(spath.c_str(), file, resourceFork);
-
-		if (rv != 0)
-			throw file_not_found_error(path);
+		file.reset(new HFSFork(m_volume.get(), resourceFork ? rec.resourceFork : rec.dataFork,
+			rec.cnid, resourceFork));
 	}
 	else
 	{
 		decmpfs_disk_header* hdr;
 		std::vector<uint8_t> holder;
 
-		hdr = get_decmpfs(be(ff.file.fileID), holder);
+		hdr = get_decmpfs(rec.cnid, holder);
 
 		if (!hdr)
 			throw file_not_found_error(path);
@@ -155,26 +249,42 @@ std::shared_ptr<Reader> HFSHighLevelVolume::openFile(const std::string& path)
 				break;
 			case DecmpfsCompressionType::CompressedResourceFork:
 			{
-				rv = m_tree->openFile(spath.c_str(), file, true);
-				if (rv == 0)
-				{
-					std::unique_ptr<ResourceFork> rsrc (new ResourceFork(file));
-					file = rsrc->getResource(DECMPFS_MAGIC, DECMPFS_ID);
-
-					if (file)
-						file.reset(new HFSZlibReader(file, hdr->uncompressed_size));
-					else
-						throw function_not_implemented_error("Could not find decmpfs resource in resource fork");
-				}
+				// The resource fork extents come with the catalog record we already have
+				file.reset(new HFSFork(m_volume.get(), rec.resourceFork, rec.cnid, true));
+
+				std::unique_ptr<ResourceFork> rsrc (new ResourceFork(file));
+				file = rsrc->getResource(DECMPFS_MAGIC, DECMPFS_ID);
+
+				if (file)
+					file.reset(new HFSZlibReader(file, hdr->uncompressed_size));
+				else
+					throw function_not_implemented_error("Could not find decmpfs resource in resource fork");
 				break;
 			}
+			case DecmpfsCompressionType::LZVNInline:
+				file.reset(new MemoryReader(hdr->attr_bytes, holder.size() - 16));
+				file.reset(new HFSLZVNReader(file, hdr->uncompressed_size, true));
+				break;
+			case DecmpfsCompressionType::LZVNResourceFork:
+				// No resource map here, the whole resource fork is the chunk table followed by data
+				file.reset(new HFSFork(m_volume.get(), rec.resourceFork, rec.cnid, true));
+				file.reset(new HFSLZVNReader(file, hdr->uncompressed_size));
+				break;
+#ifdef COMPILE_WITH_LZFSE
+			case DecmpfsCompressionType::LZFSEInline:
+				file.reset(new MemoryReader(hdr->attr_bytes, holder.size() - 16));
+				file.reset(new HFSLZFSEReader(file, hdr->uncompressed_size, true));
+				break;
+			case DecmpfsCompressionType::LZFSEResourceFork:
+				file.reset(new HFSFork(m_volume.get(), rec.resourceFork, rec.cnid, true));
+				file.reset(new HFSLZFSEReader(file, hdr->uncompressed_size));
+				break;
+#endif
 			default:
 				throw function_not_implemented_error("Unknown compression type");
 		}
 	}
 
-	file.reset(new CachedReader(file, m_volume->getFileZone(), path));
-
 	return file;
 }
 
@@ -306,44 +416,44 @@ std::vector<uint8_t> HFSHighLevelVolume::getXattr(const std::string& path, const
 	return output;
 }
 
-void HFSHighLevelVolume::hfs_nativeToStat(const HFSPlusCatalogFileOrFolder& ff, struct stat* stat, bool resourceFork)
+void HFSHighLevelVolume::hfs_nativeToStat(const HFSCatalogRecord& rec, struct stat* stat, bool resourceFork)
 {
 	assert(stat != nullptr);
 	memset(stat, 0, sizeof(*stat));
 
 #if defined(__APPLE__) && !defined(DARLING)
-	stat->st_birthtime = HFSCatalogBTree::appleToUnixTime(be(ff.file.createDate));
+	stat->st_birthtime = HFSCatalogBTree::appleToUnixTime(rec.createDate);
 #endif
-	stat->st_atime = HFSCatalogBTree::appleToUnixTime(be(ff.file.accessDate));
-	stat->st_mtime = HFSCatalogBTree::appleToUnixTime(be(ff.file.contentModDate));
-	stat->st_ctime = HFSCatalogBTree::appleToUnixTime(be(ff.file.attributeModDate));
-	stat->st_mode = be(ff.file.permissions.fileMode);
-	stat->st_uid = be(ff.file.permissions.ownerID);
-	stat->st_gid = be(ff.file.permissions.groupID);
-	stat->st_ino = be(ff.file.fileID);
+	stat->st_atime = HFSCatalogBTree::appleToUnixTime(rec.accessDate);
+	stat->st_mtime = HFSCatalogBTree::appleToUnixTime(rec.contentModDate);
+	stat->st_ctime = HFSCatalogBTree::appleToUnixTime(rec.attributeModDate);
+	stat->st_mode = rec.fileMode;
+	stat->st_uid = rec.ownerID;
+	stat->st_gid = rec.groupID;
+	stat->st_ino = rec.cnid;
 	stat->st_blksize = 512;
-	stat->st_nlink = be(ff.file.permissions.special.linkCount);
+	stat->st_nlink = rec.special; // linkCount
 
-	if (be(ff.file.recordType) == RecordType::kHFSPlusFileRecord)
+	if (rec.recordType == RecordType::kHFSPlusFileRecord)
 	{
 		if (!resourceFork)
 		{
-			stat->st_size = be(ff.file.dataFork.logicalSize);
-			stat->st_blocks = be(ff.file.dataFork.totalBlocks);
+			stat->st_size = be(rec.dataFork.logicalSize);
+			stat->st_blocks = be(rec.dataFork.totalBlocks);
 		}
 		else
 		{
-			stat->st_size = be(ff.file.resourceFork.logicalSize);
-			stat->st_blocks = be(ff.file.resourceFork.totalBlocks);
+			stat->st_size = be(rec.resourceFork.logicalSize);
+			stat->st_blocks = be(rec.resourceFork.totalBlocks);
 		}
 
 		if (S_ISCHR(stat->st_mode) || S_ISBLK(stat->st_mode))
-			stat->st_rdev = be(ff.file.permissions.special.rawDevice);
+			stat->st_rdev = rec.special; // rawDevice
 	}
 
 	if (!stat->st_mode)
 	{
-		if (be(ff.file.recordType) == RecordType::kHFSPlusFileRecord)
+		if (rec.recordType == RecordType::kHFSPlusFileRecord)
 		{
 			stat->st_mode = S_IFREG;
 			stat->st_mode |= 0444;
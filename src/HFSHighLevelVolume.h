@@ -1,9 +1,12 @@
 #ifndef HFSHIGHLEVELVOLUME_H
 #define HFSHIGHLEVELVOLUME_H
 #include <memory>
+#include <functional>
 #include <sys/stat.h>
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <chrono>
 #include "HFSVolume.h"
 #include "HFSCatalogBTree.h"
 
@@ -22,17 +25,45 @@ public:
 
 	// See exceptions.h for the list of possible exceptions
 	std::map<std::string, struct stat> listDirectory(const std::string& path);
+
+	// Streams directory entries in on-disk order, starting at cookie (0 = first entry).
+	// The visitor returns false to stop; nextCookie resumes the listing after the given entry.
+	typedef std::function<bool(const std::string& name, const struct stat& st, uint64_t nextCookie)> DirectoryVisitor;
+	void listDirectory(const std::string& path, uint64_t cookie, const DirectoryVisitor& visitor);
+	// Recently opened files are kept around (keyed by CNID) and shared on reopen. Every call
+	// returns a reader of its own though, which keeps track of how it is being read.
 	std::shared_ptr<Reader> openFile(const std::string& path);
+	// To be called after a reader returned by openFile() is dropped, lets go of idle files
+	void closeFile();
 	struct stat stat(const std::string& path);
 	std::vector<std::string> listXattr(const std::string& path);
 	std::vector<uint8_t> getXattr(const std::string& path, const std::string& xattrName);
 private:
-	void hfs_nativeToStat(const HFSPlusCatalogFileOrFolder& ff, struct stat* stat, bool resourceFork = false);
-	void hfs_nativeToStat_decmpfs(const HFSPlusCatalogFileOrFolder& ff, struct stat* stat, bool resourceFork = false);
+	void hfs_nativeToStat(const HFSCatalogRecord& rec, struct stat* stat, bool resourceFork = false);
+	void hfs_nativeToStat_decmpfs(const HFSCatalogRecord& rec, struct stat* stat, bool resourceFork = false);
 	decmpfs_disk_header* get_decmpfs(HFSCatalogNodeID cnid, std::vector<uint8_t>& holder);
+	std::shared_ptr<Reader> openFileUncached(const std::string& path, uint64_t& key);
+	std::shared_ptr<Reader> handleFor(const std::string& path, const std::shared_ptr<Reader>& file);
+	void pruneOpenFiles(bool force);
 private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct OpenFile
+	{
+		std::shared_ptr<Reader> reader; // without a cache of its own, see handleFor()
+		std::vector<std::string> paths; // the first one is the cache tag
+		Clock::time_point lastUsed;
+	};
+
+	enum { OPEN_FILE_MAX = 256, OPEN_FILE_IDLE_SECONDS = 30 };
+
 	std::shared_ptr<HFSVolume> m_volume;
 	std::unique_ptr<HFSCatalogBTree> m_tree;
+
+	// key is (CNID << 1) | resourceFork
+	std::unordered_map<uint64_t, OpenFile> m_openFiles;
+	std::unordered_map<std::string, uint64_t> m_openFilePaths;
+	Clock::time_point m_lastPrune;
 };
 
 #endif
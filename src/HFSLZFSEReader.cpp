@@ -0,0 +1,66 @@
+#include "HFSLZFSEReader.h"
+
+#ifdef COMPILE_WITH_LZFSE
+
+#include <lzfse.h>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include "exceptions.h"
+
+namespace
+{
+	// Decoder scratch buffers shared by all files, one per concurrently decoded chunk
+	std::mutex g_scratchMutex;
+	std::vector<std::unique_ptr<uint8_t[]>> g_idleScratch;
+	
+	const size_t MAX_IDLE_SCRATCH = 16;
+}
+
+HFSLZFSEReader::HFSLZFSEReader(std::shared_ptr<Reader> parent, uint64_t uncompressedSize, bool singleRun)
+: DecmpfsChunkedReader(parent, uncompressedSize, singleRun ? ChunkTable::SingleRun : ChunkTable::Offsets)
+{
+}
+
+void HFSLZFSEReader::decompressChunk(const uint8_t* in, uint32_t inLength, uint8_t* out, uint32_t outLength)
+{
+	std::unique_ptr<uint8_t[]> scratch;
+	
+	// Uncompressed chunks are marked with 0xff
+	if (in[0] == 0xff)
+	{
+		if (inLength - 1 < outLength)
+			throw io_error("Short uncompressed LZFSE chunk");
+		
+		memcpy(out, in + 1, outLength);
+		return;
+	}
+	
+	{
+		std::lock_guard<std::mutex> lock(g_scratchMutex);
+		
+		if (!g_idleScratch.empty())
+		{
+			scratch = std::move(g_idleScratch.back());
+			g_idleScratch.pop_back();
+		}
+	}
+	
+	if (!scratch)
+		scratch.reset(new uint8_t[lzfse_decode_scratch_size()]);
+	
+	const size_t decoded = lzfse_decode_buffer(out, outLength, in, inLength, scratch.get());
+	
+	{
+		std::lock_guard<std::mutex> lock(g_scratchMutex);
+		
+		if (g_idleScratch.size() < MAX_IDLE_SCRATCH)
+			g_idleScratch.push_back(std::move(scratch));
+	}
+	
+	if (decoded != outLength)
+		throw io_error("LZFSE decompression error");
+}
+
+#endif
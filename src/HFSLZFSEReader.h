@@ -0,0 +1,18 @@
+#ifndef HFSLZFSEREADER_H
+#define HFSLZFSEREADER_H
+#include "DecmpfsChunkedReader.h"
+
+#ifdef COMPILE_WITH_LZFSE
+
+// decmpfs types 11 and 12
+class HFSLZFSEReader : public DecmpfsChunkedReader
+{
+public:
+	HFSLZFSEReader(std::shared_ptr<Reader> parent, uint64_t uncompressedSize, bool singleRun = false);
+protected:
+	virtual void decompressChunk(const uint8_t* in, uint32_t inLength, uint8_t* out, uint32_t outLength) override;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,25 @@
+#include "HFSLZVNReader.h"
+#include <cstring>
+#include "lzvn.h"
+#include "exceptions.h"
+
+HFSLZVNReader::HFSLZVNReader(std::shared_ptr<Reader> parent, uint64_t uncompressedSize, bool singleRun)
+: DecmpfsChunkedReader(parent, uncompressedSize, singleRun ? ChunkTable::SingleRun : ChunkTable::Offsets)
+{
+}
+
+void HFSLZVNReader::decompressChunk(const uint8_t* in, uint32_t inLength, uint8_t* out, uint32_t outLength)
+{
+	// Uncompressed chunks start with the end-of-stream opcode
+	if (in[0] == 0x06)
+	{
+		if (inLength - 1 < outLength)
+			throw io_error("Short uncompressed LZVN chunk");
+		
+		memcpy(out, in + 1, outLength);
+		return;
+	}
+	
+	if (lzvn_decode(in, inLength, out, outLength) != outLength)
+		throw io_error("LZVN decompression error");
+}
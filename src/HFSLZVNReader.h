@@ -0,0 +1,14 @@
+#ifndef HFSLZVNREADER_H
+#define HFSLZVNREADER_H
+#include "DecmpfsChunkedReader.h"
+
+// decmpfs types 7 and 8
+class HFSLZVNReader : public DecmpfsChunkedReader
+{
+public:
+	HFSLZVNReader(std::shared_ptr<Reader> parent, uint64_t uncompressedSize, bool singleRun = false);
+protected:
+	virtual void decompressChunk(const uint8_t* in, uint32_t inLength, uint8_t* out, uint32_t outLength) override;
+};
+
+#endif
@@ -6,7 +6,10 @@
 #include "HFSExtentsOverflowBTree.h"
 #include "HFSAttributeBTree.h"
 #include "SubReader.h"
+#include "CachedReader.h"
 #include "exceptions.h"
+#include <thread>
+#include <vector>
 
 HFSVolume::HFSVolume(std::shared_ptr<Reader> reader)
 : m_reader(reader), m_embeddedReader(nullptr), m_overflowExtents(nullptr), m_attributes(nullptr),
@@ -98,4 +101,47 @@ HFSCatalogBTree* HFSVolume::rootCatalogTree()
 	return btree;
 }
 
-
+void HFSVolume::warmUpBtrees(std::mutex& mutex, const std::atomic<bool>& stop)
+{
+	struct Tree
+	{
+		const HFSPlusForkData* fork;
+		HFSCatalogNodeID cnid;
+		const char* cacheTag; // the tree's own, so that the tree finds the nodes
+	};
+	const Tree trees[] = {
+		{ &m_header.catalogFile, kHFSCatalogFileID, "Catalog" },
+		{ &m_header.attributesFile, kHFSAttributesFileID, "Attribute" },
+	};
+	std::vector<uint8_t> chunk(WARM_UP_CHUNK);
+	
+	for (const Tree& tree : trees)
+	{
+		if (tree.fork->logicalSize == 0)
+			continue;
+		
+		std::unique_lock<std::mutex> lock(mutex);
+		// Declared after the lock, the reader touches the zone when it goes away
+		std::unique_ptr<CachedReader> reader(new CachedReader(std::make_shared<HFSFork>(this, *tree.fork, tree.cnid), &m_btreeZone, tree.cacheTag));
+		const uint64_t length = reader->length();
+		
+		// Exactly the chunks asked for go into the zone
+		reader->setReadAhead(false);
+		
+		for (uint64_t offset = 0; offset < length; offset += chunk.size())
+		{
+			// Leave room for the nodes in use. Counted from what the zone holds, which includes
+			// nodes read meanwhile, and the zone may have been resized too.
+			if (stop || (m_btreeZone.size() + chunk.size() / m_btreeZone.blockSize()) * 4 > m_btreeZone.maxBlocks() * 3)
+				return;
+			
+			if (reader->read(chunk.data(), chunk.size(), offset) <= 0)
+				break;
+			
+			// Requests waiting for the volume go first
+			lock.unlock();
+			std::this_thread::yield();
+			lock.lock();
+		}
+	}
+}
@@ -6,6 +6,8 @@
 #include "CacheZone.h"
 #include <string>
 #include <memory>
+#include <mutex>
+#include <atomic>
 
 class HFSCatalogBTree;
 class HFSFork;
@@ -29,6 +31,15 @@ public:
 	
 	inline CacheZone* getFileZone() { return &m_fileZone; }
 	inline CacheZone* getBtreeZone() { return &m_btreeZone; }
+	
+	// Streams the catalog and attribute B-trees into the B-tree cache in extent order, so that
+	// the first walk over the volume finds its nodes cached. Meant to run in a thread of its own:
+	// mutex is held for every chunk read and everyone else touching the volume must take it too.
+	// Gives up once stop is set or the cache is three quarters full.
+	void warmUpBtrees(std::mutex& mutex, const std::atomic<bool>& stop);
+	
+	// Amount of data read under a single hold of the mutex by warmUpBtrees()
+	enum { WARM_UP_CHUNK = 256*1024 };
 private:
 	void processEmbeddedHFSPlus(HFSMasterDirectoryBlock* block);
 private:
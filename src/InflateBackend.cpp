@@ -0,0 +1,171 @@
+#include "InflateBackend.h"
+#include <zlib.h>
+#ifdef COMPILE_WITH_LIBDEFLATE
+	#include <libdeflate.h>
+#endif
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <new>
+
+// Keeps idle decoder states around, so that the steady state does no allocation
+template <typename T>
+class IdlePool
+{
+public:
+	IdlePool(T* (*create)(), void (*destroy)(T*)) : m_create(create), m_destroy(destroy) {}
+	
+	~IdlePool()
+	{
+		for (T* obj : m_idle)
+			m_destroy(obj);
+	}
+	
+	T* acquire()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			
+			if (!m_idle.empty())
+			{
+				T* obj = m_idle.back();
+				m_idle.pop_back();
+				return obj;
+			}
+		}
+		
+		return m_create();
+	}
+	
+	void release(T* obj)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			
+			if (m_idle.size() < MAX_IDLE)
+			{
+				m_idle.push_back(obj);
+				return;
+			}
+		}
+		
+		m_destroy(obj);
+	}
+private:
+	enum { MAX_IDLE = 16 };
+	
+	T* (*m_create)();
+	void (*m_destroy)(T*);
+	std::vector<T*> m_idle;
+	std::mutex m_mutex;
+};
+
+class ZlibInflateBackend : public InflateBackend
+{
+public:
+	ZlibInflateBackend() : m_streams(createStream, destroyStream) {}
+	
+	virtual int64_t inflate(const uint8_t* in, size_t inLength, uint8_t* out, size_t outLength) override
+	{
+		z_stream* strm = m_streams.acquire();
+		int status;
+		int64_t done;
+		
+		if (inflateReset(strm) != Z_OK)
+		{
+			destroyStream(strm);
+			return -1;
+		}
+		
+		strm->next_in = const_cast<Bytef*>(in);
+		strm->avail_in = inLength;
+		strm->next_out = out;
+		strm->avail_out = outLength;
+		
+		status = ::inflate(strm, Z_FINISH);
+		done = outLength - strm->avail_out;
+		
+		m_streams.release(strm);
+		
+		// Z_BUF_ERROR: output buffer full before the end of stream
+		if (status != Z_STREAM_END && status != Z_BUF_ERROR)
+			return -1;
+		
+		return done;
+	}
+	
+	virtual const char* name() const override { return "zlib"; }
+private:
+	static z_stream* createStream()
+	{
+		std::unique_ptr<z_stream> strm(new z_stream);
+		
+		memset(strm.get(), 0, sizeof(z_stream));
+		if (inflateInit(strm.get()) != Z_OK)
+			throw std::bad_alloc();
+		
+		return strm.release();
+	}
+	
+	static void destroyStream(z_stream* strm)
+	{
+		inflateEnd(strm);
+		delete strm;
+	}
+private:
+	IdlePool<z_stream> m_streams;
+};
+
+#ifdef COMPILE_WITH_LIBDEFLATE
+
+class LibdeflateInflateBackend : public InflateBackend
+{
+public:
+	LibdeflateInflateBackend() : m_decompressors(createDecompressor, libdeflate_free_decompressor) {}
+	
+	virtual int64_t inflate(const uint8_t* in, size_t inLength, uint8_t* out, size_t outLength) override
+	{
+		libdeflate_decompressor* decompressor = m_decompressors.acquire();
+		enum libdeflate_result result;
+		size_t done = 0;
+		
+		result = libdeflate_zlib_decompress(decompressor, in, inLength, out, outLength, &done);
+		m_decompressors.release(decompressor);
+		
+		// libdeflate can't stop at a full output buffer, let zlib handle that
+		if (result == LIBDEFLATE_INSUFFICIENT_SPACE)
+			return m_fallback.inflate(in, inLength, out, outLength);
+		if (result != LIBDEFLATE_SUCCESS)
+			return -1;
+		
+		return done;
+	}
+	
+	virtual const char* name() const override { return "libdeflate"; }
+private:
+	static libdeflate_decompressor* createDecompressor()
+	{
+		libdeflate_decompressor* decompressor = libdeflate_alloc_decompressor();
+		
+		if (!decompressor)
+			throw std::bad_alloc();
+		
+		return decompressor;
+	}
+private:
+	IdlePool<libdeflate_decompressor> m_decompressors;
+	ZlibInflateBackend m_fallback;
+};
+
+#endif
+
+InflateBackend* InflateBackend::instance()
+{
+#ifdef COMPILE_WITH_LIBDEFLATE
+	static LibdeflateInflateBackend backend;
+#else
+	static ZlibInflateBackend backend;
+#endif
+	return &backend;
+}
@@ -0,0 +1,22 @@
+#ifndef INFLATEBACKEND_H
+#define INFLATEBACKEND_H
+#include <stdint.h>
+#include <stddef.h>
+
+// One-shot decoder for complete zlib streams whose decompressed size is known up front
+// (whole DMG runs, decmpfs chunks). Implementations are thread safe.
+class InflateBackend
+{
+public:
+	virtual ~InflateBackend() {}
+	
+	// Decompresses a whole zlib stream into out.
+	// Returns the number of bytes written (at most outLength), or -1 if the data is corrupt.
+	virtual int64_t inflate(const uint8_t* in, size_t inLength, uint8_t* out, size_t outLength) = 0;
+	virtual const char* name() const = 0;
+	
+	// The fastest backend compiled in (libdeflate if enabled, zlib otherwise)
+	static InflateBackend* instance();
+};
+
+#endif
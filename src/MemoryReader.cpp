@@ -6,6 +6,11 @@ MemoryReader::MemoryReader(const uint8_t* start, size_t length)
 	m_data = std::vector<uint8_t>(start, start+length);
 }
 
+MemoryReader::MemoryReader(std::vector<uint8_t>&& data)
+: m_data(std::move(data))
+{
+}
+
 int32_t MemoryReader::read(void* buf, int32_t count, uint64_t offset)
 {
 	if (offset > m_data.size())
@@ -21,3 +26,11 @@ uint64_t MemoryReader::length()
 {
 	return m_data.size();
 }
+
+const uint8_t* MemoryReader::directData(uint64_t offset, uint64_t count)
+{
+	if (offset > m_data.size() || count > m_data.size() - offset)
+		return nullptr;
+	
+	return m_data.data() + offset;
+}
@@ -8,8 +8,11 @@ class MemoryReader : public Reader
 {
 public:
 	MemoryReader(const uint8_t* start, size_t length);
+	MemoryReader(std::vector<uint8_t>&& data);
 	virtual int32_t read(void* buf, int32_t count, uint64_t offset) override;
 	virtual uint64_t length() override;
+	virtual const uint8_t* directData(uint64_t offset, uint64_t count) override;
+	virtual bool isCaching() override { return true; }
 private:
 	std::vector<uint8_t> m_data;
 };
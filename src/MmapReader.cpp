@@ -0,0 +1,143 @@
+#include "MmapReader.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#	include <sys/vfs.h>
+#	include <linux/magic.h>
+#else
+#	include <sys/param.h>
+#	include <sys/mount.h>
+#endif
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <iostream>
+#include "exceptions.h"
+
+MmapReader::MmapReader(const std::string& path)
+: m_data(nullptr), m_length(0), m_lastEnd(0), m_prefetchedUntil(0)
+{
+	struct stat st;
+	int fd = ::open(path.c_str(), O_RDONLY);
+
+	if (fd == -1)
+	{
+#ifdef DEBUG
+		std::cerr << "Cannot open " << path << ": " << strerror(errno) << std::endl;
+#endif
+		throw file_not_found_error(path);
+	}
+	
+	if (::fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 || !isOnLocalDisk(fd))
+	{
+		::close(fd);
+		throw io_error("Cannot map " + path);
+	}
+	
+	m_length = st.st_size;
+	
+	void* data = ::mmap(nullptr, m_length, PROT_READ, MAP_PRIVATE, fd, 0);
+	
+	// The mapping stays valid after the descriptor is closed
+	::close(fd);
+	
+	if (data == MAP_FAILED)
+		throw io_error("Cannot map " + path);
+	
+	m_data = static_cast<uint8_t*>(data);
+}
+
+bool MmapReader::isOnLocalDisk(int fd)
+{
+#ifdef __linux__
+	struct statfs fs;
+	
+	if (::fstatfs(fd, &fs) == -1)
+		return false;
+	
+	// Known file systems of fixed disks (and memory), anything else is read through FileReader
+	switch (uint32_t(fs.f_type))
+	{
+		case EXT4_SUPER_MAGIC: // also ext2 and ext3
+		case XFS_SUPER_MAGIC:
+		case BTRFS_SUPER_MAGIC:
+		case F2FS_SUPER_MAGIC:
+		case TMPFS_MAGIC:
+		case OVERLAYFS_SUPER_MAGIC:
+		case 0x2FC12FC1: // ZFS
+			return true;
+		default:
+			return false;
+	}
+#else
+	struct statfs fs;
+	
+	if (::fstatfs(fd, &fs) == -1 || !(fs.f_flags & MNT_LOCAL))
+		return false;
+#	ifdef MNT_REMOVABLE
+	if (fs.f_flags & MNT_REMOVABLE)
+		return false;
+#	endif
+	return true;
+#endif
+}
+
+MmapReader::~MmapReader()
+{
+	if (m_data != nullptr)
+		::munmap(m_data, m_length);
+}
+
+int32_t MmapReader::read(void* buf, int32_t count, uint64_t offset)
+{
+	if (offset >= m_length || count <= 0)
+		return 0;
+	if (offset + count > m_length)
+		count = m_length - offset;
+	
+	adviseRead(offset, count);
+	memcpy(buf, m_data + offset, count);
+	
+	return count;
+}
+
+uint64_t MmapReader::length()
+{
+	return m_length;
+}
+
+const uint8_t* MmapReader::directData(uint64_t offset, uint64_t count)
+{
+	if (offset > m_length || count > m_length - offset)
+		return nullptr;
+	
+	// The caller is going to go through all of it
+	if (count > 0)
+	{
+		const uint64_t start = offset & ~uint64_t(::getpagesize() - 1);
+		::madvise(m_data + start, offset + count - start, MADV_WILLNEED);
+	}
+	
+	return m_data + offset;
+}
+
+void MmapReader::adviseRead(uint64_t offset, uint64_t count)
+{
+	const uint64_t end = offset + count;
+	const uint64_t prefetched = m_prefetchedUntil;
+	
+	// Random accesses (B-tree nodes and such) are left to the default kernel readahead.
+	// For a sequential stream, ask for the next window before it is needed.
+	if (m_lastEnd.exchange(end) == offset && (prefetched < end + READAHEAD_SIZE / 2 || prefetched > end + READAHEAD_SIZE))
+	{
+		const uint64_t pageMask = ~uint64_t(::getpagesize() - 1);
+		const uint64_t start = end & pageMask;
+		const uint64_t until = std::min<uint64_t>(end + READAHEAD_SIZE, m_length);
+		
+		if (until > start)
+			::madvise(m_data + start, until - start, MADV_WILLNEED);
+		m_prefetchedUntil = until;
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef MMAPREADER_H
+#define MMAPREADER_H
+#include "Reader.h"
+#include <string>
+#include <atomic>
+#include <stddef.h>
+
+// Reads an image file by mapping it into memory, saving a syscall per read
+// and letting decompressors access the compressed data in place.
+// An I/O error or truncation of the file raises SIGBUS on access instead of failing a read,
+// so only files on local disk file systems are mapped. Images on network file systems
+// (NFS, SMB, FUSE) and on FAT/exFAT/NTFS (typically removable media) go through FileReader,
+// which reports such failures as EIO. Truncating a mapped image while mounted still kills
+// the process.
+class MmapReader : public Reader
+{
+public:
+	// Throws io_error if the file cannot be mapped or lives on a file system not safe to map,
+	// callers may fall back to FileReader then
+	MmapReader(const std::string& path);
+	~MmapReader();
+	
+	int32_t read(void* buf, int32_t count, uint64_t offset) override;
+	uint64_t length() override;
+	const uint8_t* directData(uint64_t offset, uint64_t count) override;
+	bool isCaching() override { return true; }
+private:
+	void adviseRead(uint64_t offset, uint64_t count);
+	static bool isOnLocalDisk(int fd);
+private:
+	// Amount of data the kernel is asked to prefetch when reads are sequential
+	enum { READAHEAD_SIZE = 1024*1024 };
+	
+	uint8_t* m_data;
+	uint64_t m_length;
+	
+	// End of the previous read and how far the kernel was told to prefetch
+	std::atomic<uint64_t> m_lastEnd, m_prefetchedUntil;
+};
+
+#endif
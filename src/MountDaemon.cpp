@@ -0,0 +1,426 @@
+#include "MountDaemon.h"
+#include "DMGDisk.h"
+#include "DiskRunCache.h"
+#include "ThreadPool.h"
+#include "exceptions.h"
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+// Interrupts a session loop waiting for its next request
+static const int WAKE_SIGNAL = SIGUSR1;
+
+static volatile sig_atomic_t g_stopRequested = 0;
+
+static void onStopSignal(int)
+{
+	g_stopRequested = 1;
+}
+
+static void onWakeSignal(int)
+{
+}
+
+static sockaddr_un socketAddress(const std::string& path)
+{
+	sockaddr_un addr;
+
+	if (path.size() >= sizeof(addr.sun_path))
+		throw io_error("Socket path too long: " + path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+
+	return addr;
+}
+
+static bool writeAll(int fd, const std::string& data)
+{
+	size_t done = 0;
+
+	while (done < data.size())
+	{
+		ssize_t wr = ::write(fd, data.data() + done, data.size() - done);
+
+		if (wr == -1 && errno == EINTR)
+			continue;
+		if (wr <= 0)
+			return false;
+		done += wr;
+	}
+
+	return true;
+}
+
+// Reads until the peer closes the connection or, if line is set, until the end of the first line
+static std::string readAll(int fd, bool line)
+{
+	std::string data;
+	char buf[4096];
+
+	while (!line || data.find('\n') == std::string::npos)
+	{
+		ssize_t rd = ::read(fd, buf, sizeof(buf));
+
+		if (rd == -1 && errno == EINTR)
+			continue;
+		if (rd <= 0)
+			break;
+
+		data.append(buf, rd);
+
+		// Nobody has a reason to send that much
+		if (data.size() > 64*1024)
+			break;
+	}
+
+	if (line)
+		data = data.substr(0, data.find('\n'));
+
+	return data;
+}
+
+MountDaemon::MountDaemon(const std::string& socketPath, uint64_t memoryBudget, std::shared_ptr<DiskRunCache> runCache)
+: m_socketPath(socketPath), m_socket(-1), m_memoryBudget(memoryBudget), m_runCache(runCache), m_running(false)
+{
+	sockaddr_un addr = socketAddress(socketPath);
+	sigset_t stopSignals;
+
+	fillOperations(m_operations);
+
+	m_socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_socket == -1)
+		throw io_error(std::string("Cannot create socket: ") + strerror(errno));
+
+	// A daemon that went away without cleaning up leaves the socket file behind
+	::unlink(socketPath.c_str());
+
+	// Whoever may use the socket may mount images as us. The mask makes it private
+	// from the start, there is no window for others to connect before a chmod().
+	const mode_t oldMask = ::umask(0177);
+	const int bound = ::bind(m_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+	const int bindError = errno;
+
+	::umask(oldMask);
+
+	if (bound == -1 || ::listen(m_socket, 8) == -1)
+	{
+		const std::string error = strerror(bound == -1 ? bindError : errno);
+
+		::close(m_socket);
+		throw io_error("Cannot listen on " + socketPath + ": " + error);
+	}
+
+	// Stop signals are only let through while waiting for commands, the threads started
+	// for FUSE sessions and decompression inherit the blocked mask and never see them
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGINT);
+	sigaddset(&stopSignals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stopSignals, &m_originalMask);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onStopSignal;
+	::sigaction(SIGINT, &sa, nullptr);
+	::sigaction(SIGTERM, &sa, nullptr);
+
+	// Without SA_RESTART, so that the read a session loop blocks in fails with EINTR
+	sa.sa_handler = onWakeSignal;
+	::sigaction(WAKE_SIGNAL, &sa, nullptr);
+
+	// A client going away before reading its reply is no reason to die
+	::signal(SIGPIPE, SIG_IGN);
+}
+
+MountDaemon::~MountDaemon()
+{
+	while (!m_mounts.empty())
+	{
+		try
+		{
+			unmount(m_mounts.begin()->first);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "Cannot unmount " << m_mounts.begin()->first << ": " << e.what() << std::endl;
+			m_mounts.erase(m_mounts.begin());
+		}
+	}
+
+	::close(m_socket);
+	::unlink(m_socketPath.c_str());
+	pthread_sigmask(SIG_SETMASK, &m_originalMask, nullptr);
+}
+
+void MountDaemon::run()
+{
+	sigset_t waitMask = m_originalMask;
+
+	sigdelset(&waitMask, SIGINT);
+	sigdelset(&waitMask, SIGTERM);
+
+	std::cerr << "Waiting for commands on " << m_socketPath << std::endl;
+
+	m_running = true;
+	while (m_running && !g_stopRequested)
+	{
+		fd_set fds;
+		int client;
+
+		FD_ZERO(&fds);
+		FD_SET(m_socket, &fds);
+
+		if (::pselect(m_socket + 1, &fds, nullptr, nullptr, nullptr, &waitMask) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw io_error(std::string("Cannot wait for commands: ") + strerror(errno));
+		}
+
+		client = ::accept(m_socket, nullptr, nullptr);
+		if (client == -1)
+			continue;
+
+		std::vector<std::string> args;
+		std::istringstream line(readAll(client, true));
+		std::string arg;
+
+		while (std::getline(line, arg, '\t'))
+			args.push_back(arg);
+
+		writeAll(client, handleCommand(args));
+		::close(client);
+	}
+}
+
+std::string MountDaemon::handleCommand(const std::vector<std::string>& args)
+{
+	try
+	{
+		if (args.size() == 3 && args[0] == "mount")
+			mount(args[1], args[2]);
+		else if (args.size() == 2 && args[0] == "unmount")
+			unmount(args[1]);
+		else if (args.size() == 1 && args[0] == "list")
+			return "OK\n" + list();
+		else if (args.size() == 1 && args[0] == "stats")
+			return "OK\n" + stats();
+		else if (args.size() == 1 && args[0] == "shutdown")
+			m_running = false;
+		else
+			return "ERROR Unknown command or wrong number of arguments\n";
+
+		return "OK\n";
+	}
+	catch (const file_not_found_error& e)
+	{
+		return std::string("ERROR No such file: ") + e.what() + "\n";
+	}
+	catch (const std::exception& e)
+	{
+		return std::string("ERROR ") + e.what() + "\n";
+	}
+}
+
+void MountDaemon::mount(const std::string& imagePath, const std::string& mountPoint)
+{
+	std::unique_ptr<Mount> mount(new Mount);
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse* fuse;
+	std::atomic<bool>* loopDone;
+
+	if (m_mounts.count(mountPoint))
+		throw std::runtime_error("Something is mounted at " + mountPoint + " already");
+
+	mount->imagePath = imagePath;
+	mount->mountPoint = mountPoint;
+
+	openDisk(mount->image, imagePath.c_str(), m_runCache);
+
+	fuse_opt_add_arg(&args, "darling-dmg");
+	fuse_opt_add_arg(&args, "-oro");
+
+	mount->channel = fuse_mount(mountPoint.c_str(), &args);
+	if (mount->channel != nullptr)
+		mount->fuse = fuse_new(mount->channel, &args, &m_operations, sizeof(m_operations), &mount->image);
+
+	fuse_opt_free_args(&args);
+
+	if (mount->fuse == nullptr)
+	{
+		if (mount->channel != nullptr)
+			fuse_unmount(mountPoint.c_str(), mount->channel);
+		throw io_error("Cannot mount " + imagePath + " at " + mountPoint);
+	}
+
+	// Single threaded like a standalone mount, the image's cache zones aren't thread safe
+	fuse = mount->fuse;
+	loopDone = &mount->loopDone;
+	mount->thread = std::thread([fuse, loopDone]() {
+		fuse_loop(fuse);
+		*loopDone = true;
+	});
+
+	m_mounts[mountPoint] = std::move(mount);
+	rebalance();
+
+	std::cerr << "Mounted " << imagePath << " at " << mountPoint << std::endl;
+}
+
+void MountDaemon::unmount(const std::string& mountPoint)
+{
+	auto it = m_mounts.find(mountPoint);
+
+	if (it == m_mounts.end())
+		throw std::runtime_error("Nothing is mounted at " + mountPoint);
+
+	Mount& mount = *it->second;
+
+	// The session loop checks the exit flag between requests, like in fuse_main() a signal gets
+	// it out of the read it waits in. The signal may come just before the loop blocks, so
+	// repeat it until the loop is done. The channel is only unmounted once nothing uses it.
+	fuse_exit(mount.fuse);
+	while (!mount.loopDone)
+	{
+		pthread_kill(mount.thread.native_handle(), WAKE_SIGNAL);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	mount.thread.join();
+
+	// FUSE calls hfs_destroy() only if the session got as far as initialising
+	finishWarmUp(mount.image);
+
+	fuse_unmount(mountPoint.c_str(), mount.channel);
+	fuse_destroy(mount.fuse);
+
+	std::cerr << "Unmounted " << mount.imagePath << " from " << mountPoint << std::endl;
+
+	m_mounts.erase(it);
+	rebalance();
+}
+
+std::string MountDaemon::list() const
+{
+	std::ostringstream out;
+
+	for (const auto& entry : m_mounts)
+		out << entry.first << '\t' << entry.second->imagePath << '\n';
+
+	return out.str();
+}
+
+static void describeZone(std::ostream& out, const std::string& mountPoint, const char* name, const CacheZone* zone)
+{
+	const float hitRate = zone->hitRate();
+
+	out << mountPoint << '\t' << name << '\t' << zone->size() << '/' << zone->maxBlocks()
+		<< " blocks of " << zone->blockSize() << '\t'
+		<< "hit rate " << (std::isnan(hitRate) ? 0.0f : hitRate);
+
+	if (zone->compressedLimit() > 0)
+		out << '\t' << zone->compressedSize() << " compressed blocks in " << zone->compressedBytes() << " bytes";
+
+	out << '\n';
+}
+
+std::string MountDaemon::stats() const
+{
+	std::ostringstream out;
+
+	out << "images\t" << m_mounts.size() << '\n';
+	out << "decompression threads\t" << ThreadPool::instance()->concurrency() << '\n';
+	out << "memory budget\t" << m_memoryBudget << '\n';
+
+	for (const auto& entry : m_mounts)
+	{
+		MountedImage& image = entry.second->image;
+		std::lock_guard<std::mutex> lock(image.mutex);
+		DMGDisk* dmg = dynamic_cast<DMGDisk*>(image.partitions.get());
+
+		if (dmg != nullptr)
+			describeZone(out, entry.first, "dmg", dmg->cacheZone());
+
+		describeZone(out, entry.first, "file", image.volume->getFileZone());
+		describeZone(out, entry.first, "btree", image.volume->getBtreeZone());
+	}
+
+	return out.str();
+}
+
+void MountDaemon::rebalance()
+{
+	if (m_memoryBudget == 0 || m_mounts.empty())
+		return;
+
+	const uint64_t share = m_memoryBudget / m_mounts.size();
+
+	auto resize = [](CacheZone* zone, uint64_t bytes) {
+		zone->setMaxBlocks(std::max<uint64_t>(bytes / zone->blockSize(), 1));
+	};
+
+	for (auto& entry : m_mounts)
+	{
+		MountedImage& image = entry.second->image;
+		std::lock_guard<std::mutex> lock(image.mutex);
+		DMGDisk* dmg = dynamic_cast<DMGDisk*>(image.partitions.get());
+		uint64_t volumeShare = share;
+
+		// Same proportions as the defaults: decompressed data first, then files and B-trees
+		if (dmg != nullptr)
+		{
+			resize(dmg->cacheZone(), share / 2);
+			volumeShare = share / 2;
+		}
+
+		resize(image.volume->getFileZone(), volumeShare / 2);
+		resize(image.volume->getBtreeZone(), volumeShare / 2);
+	}
+}
+
+int MountDaemon::control(const std::string& socketPath, const std::vector<std::string>& command)
+{
+	sockaddr_un addr = socketAddress(socketPath);
+	std::string request, reply;
+	int fd;
+
+	for (size_t i = 0; i < command.size(); i++)
+	{
+		if (i > 0)
+			request += '\t';
+		request += command[i];
+	}
+	request += '\n';
+
+	fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)
+	{
+		std::cerr << "Cannot connect to " << socketPath << ": " << strerror(errno) << std::endl;
+		if (fd != -1)
+			::close(fd);
+		return 1;
+	}
+
+	writeAll(fd, request);
+	::shutdown(fd, SHUT_WR);
+	reply = readAll(fd, false);
+	::close(fd);
+
+	if (reply.compare(0, 3, "OK\n") == 0)
+	{
+		std::cout << reply.substr(3);
+		return 0;
+	}
+
+	std::cerr << reply;
+	return 1;
+}
@@ -0,0 +1,61 @@
+#ifndef MOUNTDAEMON_H
+#define MOUNTDAEMON_H
+#include "main-fuse.h"
+#include <signal.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Serves several images from a single process. Images are added and removed by commands
+// sent to a Unix socket, one line per command with its arguments separated by tabs:
+//   mount <image> <mount point>, unmount <mount point>, list, stats, shutdown
+// The reply starts with a line saying "OK" or "ERROR <reason>".
+// All images share the decompression thread pool, the run caches and one memory budget
+// for their cache zones. Each image gets a FUSE session and thread of its own.
+class MountDaemon
+{
+public:
+	// memoryBudget is split between the cache zones of all images, 0 leaves them at their defaults.
+	// Throws io_error if the socket cannot be set up.
+	MountDaemon(const std::string& socketPath, uint64_t memoryBudget, std::shared_ptr<DiskRunCache> runCache);
+	~MountDaemon();
+
+	// Handles commands until told to shut down or SIGINT/SIGTERM arrives
+	void run();
+
+	// Sends a command to a running daemon and prints the reply, returns the exit code for it
+	static int control(const std::string& socketPath, const std::vector<std::string>& command);
+private:
+	struct Mount
+	{
+		std::string imagePath, mountPoint;
+		MountedImage image;
+		struct fuse_chan* channel = nullptr;
+		struct fuse* fuse = nullptr;
+		std::thread thread;
+		std::atomic<bool> loopDone { false };
+	};
+
+	std::string handleCommand(const std::vector<std::string>& args);
+	void mount(const std::string& imagePath, const std::string& mountPoint);
+	void unmount(const std::string& mountPoint);
+	std::string list() const;
+	std::string stats() const;
+	// Splits the memory budget evenly between the images
+	void rebalance();
+private:
+	std::string m_socketPath;
+	int m_socket;
+	uint64_t m_memoryBudget;
+	std::shared_ptr<DiskRunCache> m_runCache;
+	struct fuse_operations m_operations;
+	std::map<std::string, std::unique_ptr<Mount>> m_mounts; // by mount point
+	bool m_running;
+	sigset_t m_originalMask;
+};
+
+#endif
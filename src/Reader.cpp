@@ -1,6 +1,12 @@
 #include "Reader.h"
 #include "CacheZone.h"
 
+void Reader::readBatch(ReadRequest* requests, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		requests[i].result = read(requests[i].buf, requests[i].count, requests[i].offset);
+}
+
 void Reader::adviseOptimalBlock(uint64_t offset, uint64_t& blockStart, uint64_t& blockEnd)
 {
 	// Default implementation returns a block aligned to a 4096-byte boundary
@@ -1,6 +1,7 @@
 #ifndef READER_H
 #define READER_H
 #include <stdint.h>
+#include <stddef.h>
 
 class Reader
 {
@@ -8,10 +9,32 @@ public:
 	virtual ~Reader() {}
 	virtual int32_t read(void* buf, int32_t count, uint64_t offset) = 0;
 	virtual uint64_t length() = 0;
+	
+	// A single read within a batch
+	struct ReadRequest
+	{
+		void* buf;
+		int32_t count;
+		uint64_t offset;
+		int32_t result; // set on completion to what read() would have returned
+	};
+	
+	// Submits independent reads together and returns once all of them have completed.
+	// Readers that can overlap the requests (io_uring, worker threads) or merge them with
+	// their own work override this, the default performs them one after another.
+	virtual void readBatch(ReadRequest* requests, size_t count);
 
 	// Advises cache on the amount of data it should read in order to avoid repeatedly decompressing
 	// the same blocks of data.
 	virtual void adviseOptimalBlock(uint64_t offset, uint64_t& blockStart, uint64_t& blockEnd);
+	
+	// Returns a pointer to count bytes at offset if the reader holds them in memory, nullptr otherwise.
+	// The data remains valid as long as the reader exists.
+	virtual const uint8_t* directData(uint64_t /*offset*/, uint64_t /*count*/) { return nullptr; }
+	
+	// True if the data comes from memory already (a cache zone or a mapped file),
+	// so that putting another cache on top would only hold the same bytes twice.
+	virtual bool isCaching() { return false; }
 };
 
 #endif
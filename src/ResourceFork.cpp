@@ -3,6 +3,9 @@
 #include "be.h"
 #include <stddef.h>
 #include <memory>
+#include <vector>
+#include <cstring>
+#include <algorithm>
 #include "SubReader.h"
 
 ResourceFork::ResourceFork(std::shared_ptr<Reader> reader)
@@ -26,6 +29,7 @@ void ResourceFork::loadResources()
 	HFSResourceForkHeader header;
 	HFSResourceMapHeader mapHeader;
 	HFSResourceList listHeader;
+	std::vector<uint8_t> map;
 	
 	if (m_reader->read(&header, sizeof(header), 0) != sizeof(header))
 		throw std::runtime_error("Short read of resource fork header");
@@ -35,12 +39,32 @@ void ResourceFork::loadResources()
 	header.dataLength = be(header.dataLength);
 	header.mapLength = be(header.mapLength);
 	
-	if (m_reader->read(&mapHeader, sizeof(mapHeader), header.mapOffset) != sizeof(mapHeader))
+	// The whole map (header, type list, reference lists) normally sits in mapLength bytes.
+	// Fetch it at once and parse it from memory.
+	if (header.mapLength > 0 && header.mapLength <= MAX_MAP_LENGTH)
+	{
+		map.resize(header.mapLength);
+		
+		int32_t rd = m_reader->read(&map[0], map.size(), header.mapOffset);
+		map.resize(std::max<int32_t>(rd, 0));
+	}
+	
+	// Falls back to reading from the fork for anything that lies outside of the map
+	auto fetch = [&](void* dest, uint32_t length, uint64_t offset) -> bool {
+		if (offset >= header.mapOffset && offset + length <= header.mapOffset + map.size())
+		{
+			memcpy(dest, &map[offset - header.mapOffset], length);
+			return true;
+		}
+		return m_reader->read(dest, length, offset) == int32_t(length);
+	};
+	
+	if (!fetch(&mapHeader, sizeof(mapHeader), header.mapOffset))
 		throw std::runtime_error("Short read of resource fork map header");
 	
 	mapHeader.listOffset = be(mapHeader.listOffset);
 	
-	if (m_reader->read(&listHeader, sizeof(listHeader), header.mapOffset + mapHeader.listOffset) != sizeof(listHeader))
+	if (!fetch(&listHeader, sizeof(listHeader), header.mapOffset + mapHeader.listOffset))
 		throw std::runtime_error("Short read of resource fork map list");
 	
 	listHeader.count = be(listHeader.count);
@@ -52,7 +76,7 @@ void ResourceFork::loadResources()
 		std::unique_ptr<HFSResourcePointer[]> ptrs;
 		const int offset = pos + sizeof(item)*i;
 		
-		if (m_reader->read(&item, sizeof(item), offset) != sizeof(item))
+		if (!fetch(&item, sizeof(item), offset))
 			throw std::runtime_error("Short read of an HFSResourceListItem");
 		
 		item.type = be(item.type);
@@ -61,24 +85,15 @@ void ResourceFork::loadResources()
 		
 		ptrs.reset(new HFSResourcePointer[item.count+1]);
 		
-		if (m_reader->read(ptrs.get(), sizeof(HFSResourcePointer) * (item.count+1), offset + item.offset) != sizeof(HFSResourcePointer) * (item.count+1))
+		if (!fetch(ptrs.get(), sizeof(HFSResourcePointer) * (item.count+1), offset + item.offset))
 			throw std::runtime_error("Short read of HFSResourcePointers");
 		
 		for (int j = 0; j < item.count+1; j++)
 		{
-			HFSResourceHeader hdr;
 			Resource res = { item.type, be(ptrs[j].resourceId) };
-			ResourceLocation loc;
 			
-			loc.offset = header.dataOffset + be(ptrs[j].dataOffset);
-			
-			if (m_reader->read(&hdr, sizeof(hdr), loc.offset) != sizeof(hdr))
-				throw std::runtime_error("Short read of HFSResourceHeader");
-			
-			loc.offset += offsetof(HFSResourceHeader, data);
-			loc.length = be(hdr.length);
-			
-			m_resources.insert({ res, loc });
+			// Resource length is only read once the resource is requested
+			m_resources.insert({ res, header.dataOffset + be(ptrs[j].dataOffset) });
 		}
 	}
 }
@@ -88,8 +103,13 @@ std::shared_ptr<Reader> ResourceFork::getResource(uint32_t resourceType, uint16_
 	Resource res = { resourceType, id };
 	auto it = m_resources.find(res);
 	
+	HFSResourceHeader hdr;
+	
 	if (it == m_resources.end())
 		return nullptr;
-	else
-		return std::shared_ptr<Reader>(new SubReader(m_reader, it->second.offset, it->second.length));
+	
+	if (m_reader->read(&hdr, sizeof(hdr), it->second) != sizeof(hdr))
+		throw std::runtime_error("Short read of HFSResourceHeader");
+	
+	return std::shared_ptr<Reader>(new SubReader(m_reader, it->second + offsetof(HFSResourceHeader, data), be(hdr.length)));
 }
@@ -22,14 +22,13 @@ private:
 		uint32_t type;
 		uint16_t id;
 	};
-	struct ResourceLocation
-	{
-		uint64_t offset;
-		uint32_t length;
-	};
+	// Resource maps are limited to 16 MB by the format
+	static const uint32_t MAX_MAP_LENGTH = 16*1024*1024;
+	
 	friend bool operator<(const ResourceFork::Resource& t, const ResourceFork::Resource& that);
 	
-	std::map<Resource, ResourceLocation> m_resources;
+	// resource -> offset of its HFSResourceHeader
+	std::map<Resource, uint64_t> m_resources;
 };
 
 #endif
@@ -0,0 +1,124 @@
+#include "SharedRunCache.h"
+#include <openssl/evp.h>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+SharedRunCache* SharedRunCache::instance()
+{
+	static SharedRunCache cache;
+	return &cache;
+}
+
+void SharedRunCache::setLimit(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_limit = bytes;
+	evict();
+}
+
+void SharedRunCache::setBacking(std::shared_ptr<DiskRunCache> backing)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_backing = backing;
+}
+
+bool SharedRunCache::enabled() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_limit > 0 || m_backing;
+}
+
+std::string SharedRunCache::runName(RunType type, const uint8_t* compressed, size_t length, uint64_t runLength)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digestLength;
+	std::ostringstream name;
+
+	if (!EVP_Digest(compressed, length, digest, &digestLength, EVP_sha256(), nullptr))
+		throw std::logic_error("Cannot compute SHA-256 of a run");
+
+	name << std::hex << std::setfill('0');
+	for (unsigned int i = 0; i < digestLength; i++)
+		name << std::setw(2) << unsigned(digest[i]);
+
+	// The same bytes could decode differently with another method
+	name << '-' << uint32_t(type) << '-' << runLength;
+
+	return name.str();
+}
+
+bool SharedRunCache::read(const std::string& name, uint64_t runLength, void* buf, uint64_t offset, size_t count)
+{
+	std::shared_ptr<DiskRunCache> backing;
+
+	if (offset + count > runLength)
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_runs.find(name);
+
+		if (it != m_runs.end() && it->second.data.size() == runLength)
+		{
+			memcpy(buf, &it->second.data[offset], count);
+			m_runAge.splice(m_runAge.end(), m_runAge, it->second.itAge);
+			return true;
+		}
+
+		backing = m_backing;
+	}
+
+	if (backing)
+	{
+		std::shared_ptr<Reader> run = backing->get(name, runLength);
+
+		if (run && run->read(buf, count, offset) == int32_t(count))
+			return true;
+	}
+
+	return false;
+}
+
+void SharedRunCache::store(const std::string& name, const void* data, size_t length)
+{
+	std::shared_ptr<DiskRunCache> backing;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		backing = m_backing;
+
+		if (length <= m_limit && m_runs.find(name) == m_runs.end())
+		{
+			Run& run = m_runs[name];
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+			run.data.assign(bytes, bytes + length);
+			m_runAge.push_back(name);
+			run.itAge = --m_runAge.end();
+			m_bytes += length;
+
+			evict();
+		}
+	}
+
+	if (backing && !backing->contains(name, length))
+		backing->store(name, data, length);
+}
+
+void SharedRunCache::evict()
+{
+	while (m_bytes > m_limit)
+	{
+		auto it = m_runs.find(m_runAge.front());
+
+		m_bytes -= it->second.data.size();
+		m_runAge.pop_front();
+		m_runs.erase(it);
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef SHAREDRUNCACHE_H
+#define SHAREDRUNCACHE_H
+#include <stdint.h>
+#include <stddef.h>
+#include "dmg.h"
+#include "DiskRunCache.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Decompressed runs named after a hash of their compressed data, so that images with
+// runs in common (successive versions of an SDK image, say) decode each of them once.
+// A single instance serves all images of the process. Other processes are reached
+// through a DiskRunCache on a shared memory file system such as /dev/shm, whose
+// run files all of them map.
+class SharedRunCache
+{
+public:
+	static SharedRunCache* instance();
+
+	// Memory for runs kept within the process, 0 (the default) keeps none
+	void setLimit(size_t bytes);
+	// Runs are also looked up in and added to backing, nullptr (the default) turns it off
+	void setBacking(std::shared_ptr<DiskRunCache> backing);
+	bool enabled() const;
+
+	// Name of a run of the given type, compressed data and decompressed length
+	static std::string runName(RunType type, const uint8_t* compressed, size_t length, uint64_t runLength);
+
+	// Copies count bytes from offset of the run into buf, returns false if the run isn't cached
+	bool read(const std::string& name, uint64_t runLength, void* buf, uint64_t offset, size_t count);
+	void store(const std::string& name, const void* data, size_t length);
+private:
+	SharedRunCache() = default;
+	void evict();
+private:
+	struct Run
+	{
+		std::vector<uint8_t> data;
+		std::list<std::string>::iterator itAge;
+	};
+
+	std::unordered_map<std::string, Run> m_runs;
+	std::list<std::string> m_runAge;
+	size_t m_limit = 0, m_bytes = 0;
+	std::shared_ptr<DiskRunCache> m_backing;
+	mutable std::mutex m_mutex;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "SubReader.h"
+#include <vector>
 
 SubReader::SubReader(std::shared_ptr<Reader> parent, uint64_t offset, uint64_t size)
 : m_parent(parent), m_offset(offset), m_size(size)
@@ -15,6 +16,25 @@ int32_t SubReader::read(void* buf, int32_t count, uint64_t offset)
 	return m_parent->read(buf, count, offset + m_offset);
 }
 
+void SubReader::readBatch(ReadRequest* requests, size_t count)
+{
+	std::vector<ReadRequest> parentRequests(requests, requests + count);
+	
+	for (ReadRequest& req : parentRequests)
+	{
+		if (req.offset > m_size)
+			req.count = 0;
+		else if (req.offset + req.count > m_size)
+			req.count = m_size - req.offset;
+		req.offset += m_offset;
+	}
+	
+	m_parent->readBatch(parentRequests.data(), count);
+	
+	for (size_t i = 0; i < count; i++)
+		requests[i].result = parentRequests[i].result;
+}
+
 uint64_t SubReader::length()
 {
 	return m_size;
@@ -32,3 +52,11 @@ void SubReader::adviseOptimalBlock(uint64_t offset, uint64_t& blockStart, uint64
 	if (blockEnd > m_size)
 		blockEnd = m_size;
 }
+
+const uint8_t* SubReader::directData(uint64_t offset, uint64_t count)
+{
+	if (offset > m_size || count > m_size - offset)
+		return nullptr;
+	
+	return m_parent->directData(offset + m_offset, count);
+}
@@ -11,7 +11,10 @@ public:
 	
 	virtual int32_t read(void* buf, int32_t count, uint64_t offset) override;
 	virtual uint64_t length() override;
+	virtual void readBatch(ReadRequest* requests, size_t count) override;
 	virtual void adviseOptimalBlock(uint64_t offset, uint64_t& blockStart, uint64_t& blockEnd) override;
+	virtual const uint8_t* directData(uint64_t offset, uint64_t count) override;
+	virtual bool isCaching() override { return m_parent->isCaching(); }
 private:
 	std::shared_ptr<Reader> m_parent;
 	uint64_t m_offset, m_size;
@@ -0,0 +1,140 @@
+#include "ThreadPool.h"
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <algorithm>
+
+std::atomic<bool> ThreadPool::s_threadsAllowed(true);
+
+ThreadPool::ThreadPool(unsigned int threads)
+: m_threads(threads)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+
+	for (std::thread& t : m_workers)
+		t.join();
+}
+
+void ThreadPool::setThreadsAllowed(bool allowed)
+{
+	s_threadsAllowed = allowed;
+}
+
+bool ThreadPool::startWorkers()
+{
+	if (m_threads == 0 || !s_threadsAllowed)
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_workers.empty())
+	{
+		for (unsigned int i = 0; i < m_threads; i++)
+			m_workers.emplace_back(&ThreadPool::workerLoop, this);
+	}
+
+	return true;
+}
+
+ThreadPool* ThreadPool::instance()
+{
+	// The calling thread always helps, hence one worker less than CPUs
+	static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+	return &pool;
+}
+
+void ThreadPool::workerLoop()
+{
+	while (true)
+	{
+		std::function<void()> task;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+
+			if (m_queue.empty())
+				return;
+
+			task = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		task();
+	}
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& fn)
+{
+	struct State
+	{
+		std::atomic<size_t> next { 0 };
+		size_t finished = 0;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable cond;
+	};
+
+	if (count == 0)
+		return;
+	if (count == 1 || !startWorkers())
+	{
+		for (size_t i = 0; i < count; i++)
+			fn(i);
+		return;
+	}
+
+	// Helpers may still sit in the queue after we return, so they share ownership of the state.
+	// They never touch fn once all indices have been claimed.
+	std::shared_ptr<State> state = std::make_shared<State>();
+	const std::function<void(size_t)>* pfn = &fn;
+
+	auto work = [state, pfn, count]() {
+		size_t i;
+
+		while ((i = state->next++) < count)
+		{
+			std::exception_ptr error;
+
+			try
+			{
+				(*pfn)(i);
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+
+			std::lock_guard<std::mutex> lock(state->mutex);
+			if (error && !state->error)
+				state->error = error;
+			if (++state->finished == count)
+				state->cond.notify_all();
+		}
+	};
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const size_t helpers = std::min<size_t>(count - 1, m_threads);
+
+		for (size_t i = 0; i < helpers; i++)
+			m_queue.push_back(work);
+	}
+	m_cond.notify_all();
+
+	work();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->cond.wait(lock, [&]() { return state->finished == count; });
+
+	if (state->error)
+		std::rethrow_exception(state->error);
+}
@@ -0,0 +1,49 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#include <stddef.h>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// A fixed set of worker threads shared by everything that wants to decompress in parallel.
+// The workers are started by the first parallelFor() that needs them.
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned int threads);
+	~ThreadPool();
+
+	// Process-wide pool sized after the number of CPUs
+	static ThreadPool* instance();
+
+	// While disallowed, no pool starts workers and parallelFor() does all the work in the caller.
+	// For processes that are yet to fork into the background, threads don't survive that.
+	static void setThreadsAllowed(bool allowed);
+
+	// Number of threads that can work at the same time, including the caller
+	inline unsigned int concurrency() const { return m_threads + 1; }
+
+	// Runs fn(0) ... fn(count-1) and returns once all of them have finished.
+	// The calling thread takes part in the work, so nested calls from within
+	// a worker cannot deadlock. The first exception thrown by fn is rethrown.
+	void parallelFor(size_t count, const std::function<void(size_t)>& fn);
+private:
+	void workerLoop();
+	// Returns false if the pool has to do without workers
+	bool startWorkers();
+private:
+	static std::atomic<bool> s_threadsAllowed;
+
+	const unsigned int m_threads;
+	std::vector<std::thread> m_workers;
+	std::deque<std::function<void()>> m_queue;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_stop = false;
+};
+
+#endif
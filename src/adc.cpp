@@ -16,102 +16,76 @@ enum
  * long phrase  - 3 byte header + data, first byte 0x40-0x7F, max length 0x43 (6 bits + 4), max offset 0xFFFF (16 bits)
  */
 
-int adc_decompress(int in_size, uint8_t* input, int avail_size, uint8_t* output, int restartIndex, int* bytes_written)
+// Copies a phrase which may overlap with its destination
+static inline void adc_copy_match(uint8_t* op, size_t distance, size_t length, size_t room)
 {
-	if (in_size == 0)
-		return 0;
-	
-	bool output_full = false;
-	bool input_short = false;
-	unsigned char *inp = input;
-	unsigned char *outp = output + restartIndex;
-	int chunk_size;
-	int offset;
-
-	while (inp - input < in_size)
+	const uint8_t* from = op - distance;
+
+	if (distance == 1)
+		memset(op, *from, length);
+	else if (distance >= 8 && length + 8 <= room)
 	{
-		int chunk_type = adc_chunk_type(*inp);
-		switch (chunk_type)
+		// Wide copies when 8 byte steps can't overlap and there's room to overshoot
+		for (size_t i = 0; i < length; i += 8)
+			memcpy(op + i, from + i, 8);
+	}
+	else
+	{
+		for (size_t i = 0; i < length; i++)
+			op[i] = from[i];
+	}
+}
+
+int64_t adc_decode(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity, size_t* dst_pos, size_t dst_stop)
+{
+	const uint8_t* ip = src;
+	const uint8_t* const iend = src + src_size;
+	uint8_t* op = dst + *dst_pos;
+	uint8_t* const ostop = dst + dst_stop;
+	uint8_t* const oend = dst + dst_capacity;
+
+	while (ip < iend && op < ostop)
+	{
+		const uint8_t b = *ip;
+		size_t length, distance, header;
+
+		switch (adc_chunk_type(b))
 		{
-		case ADC_PLAIN:
-			chunk_size = adc_chunk_size(*inp);
-			if ( inp - input > in_size - (chunk_size+1) ) {
-				input_short = true;
-				break;
-			}
-			if (outp + chunk_size - output > avail_size)
-			{
-				output_full = true;
-				break;
-			}
-			memcpy(outp, inp + 1, chunk_size);
-			inp += chunk_size + 1;
-			outp += chunk_size;
-			break;
+			case ADC_PLAIN:
+				length = adc_chunk_size(b);
+				if (size_t(iend - ip) < length + 1 || size_t(oend - op) < length)
+					goto out;
 
-		case ADC_2BYTE:
-			if ( inp - input > in_size - 2 ) {
-				input_short = true;
-				break;
-			}
-			chunk_size = adc_chunk_size(*inp);
-			offset = adc_chunk_offset(inp);
-			if (outp + chunk_size - output > avail_size)
-			{
-				output_full = true;
+				memcpy(op, ip + 1, length);
+				ip += length + 1;
+				op += length;
+				continue;
+			case ADC_2BYTE:
+				header = 2;
 				break;
-			}
-			if (offset == 0)
-			{
-				memset(outp, *(outp - offset - 1), chunk_size);
-				outp += chunk_size;
-				inp += 2;
-			}
-			else
-			{
-				for (int i = 0; i < chunk_size; i++)
-				{
-					memcpy(outp, outp - offset - 1, 1);
-					outp++;
-				}
-				inp += 2;
-			}
-			break;
+			default:
+				header = 3;
+		}
 
-		case ADC_3BYTE:
-			if ( inp - input > in_size - 3 ) {
-				input_short = true;
-				break;
-			}
-			chunk_size = adc_chunk_size(*inp);
-			offset = adc_chunk_offset(inp);
-			if (outp + chunk_size - output > avail_size)
-			{
-				output_full = true;
-				break;
-			}
-			if (offset == 0)
-			{
-				memset(outp, *(outp - offset - 1), chunk_size);
-				outp += chunk_size;
-				inp += 3;
-			}
-			else
-			{
-				for (int i = 0; i < chunk_size; i++)
-				{
-					memcpy(outp, outp - offset - 1, 1);
-					outp++;
-				}
-				inp += 3;
-			}
+		if (size_t(iend - ip) < header)
 			break;
-		}
-		if (output_full || input_short)
+
+		length = adc_chunk_size(b);
+		distance = adc_chunk_offset(const_cast<uint8_t*>(ip)) + 1;
+
+		if (distance > size_t(op - dst))
+			return -1;
+		if (size_t(oend - op) < length)
 			break;
+
+		adc_copy_match(op, distance, length, oend - op);
+		ip += header;
+		op += length;
 	}
-	*bytes_written = outp - output;
-	return inp - input;
+
+out:
+	*dst_pos = op - dst;
+	return ip - src;
 }
 
 int adc_chunk_type(char _byte)
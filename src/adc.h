@@ -1,8 +1,13 @@
 #ifndef ADC_H
 #define ADC_H
 #include <stdint.h>
+#include <stddef.h>
 
-int adc_decompress(int in_size, uint8_t* input, int avail_size, uint8_t* output, int restartIndex, int* bytes_written);
+// Decodes ADC phrases from src straight into dst, starting at *dst_pos.
+// dst[0 .. *dst_pos) holds previous output and serves as the lookback window.
+// Decoding stops once *dst_pos reaches dst_stop, a phrase no longer fits into dst_capacity or input runs out.
+// Returns the number of input bytes consumed (only whole phrases), or -1 on invalid data.
+int64_t adc_decode(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity, size_t* dst_pos, size_t dst_stop);
 int adc_chunk_type(char _byte);
 int adc_chunk_size(char _byte);
 int adc_chunk_offset(unsigned char *chunk_start);
@@ -0,0 +1,219 @@
+#include <stdint.h>
+#include <cstring>
+#include <algorithm>
+#include "lz4.h"
+
+/* A block is a series of sequences:
+ * token     LLLLMMMM                     L = literal count, M = match length - 4, 15 means more follow
+ * [length]  255, 255, ..., <255          added to L if it was 15
+ * literals
+ * distance  DDDDDDDD DDDDDDDD            little endian, 1-65535
+ * [length]  255, 255, ..., <255          added to M if it was 15
+ * The last sequence ends after its literals. The last 5 bytes are always literals
+ * and the last match starts at least 12 bytes before the end of the block.
+ */
+
+enum
+{
+	LZ4_MIN_MATCH = 4,
+	LZ4_MF_LIMIT = 12,
+	LZ4_LAST_LITERALS = 5,
+	LZ4_MAX_DISTANCE = 65535,
+	LZ4_HASH_LOG = 12
+};
+
+static inline uint32_t read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hashSequence(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Number of extra length bytes for a literal count or a match length (without the minimum)
+static inline size_t lengthBytes(size_t length)
+{
+	return length < 15 ? 0 : (length - 15) / 255 + 1;
+}
+
+static inline uint8_t* writeLength(uint8_t* op, size_t length)
+{
+	if (length < 15)
+		return op;
+
+	for (length -= 15; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = uint8_t(length);
+	return op;
+}
+
+static inline bool readLength(const uint8_t*& ip, const uint8_t* iend, size_t& length)
+{
+	uint8_t b;
+
+	do
+	{
+		if (ip >= iend)
+			return false;
+		b = *ip++;
+		length += b;
+	}
+	while (b == 255);
+
+	return true;
+}
+
+// Copies a match which may overlap with its destination
+static inline void copyMatch(uint8_t* op, size_t distance, size_t length, size_t room)
+{
+	const uint8_t* from = op - distance;
+
+	// Wide copies when 8 byte steps can't overlap and there's room to overshoot
+	if (distance >= 8 && length + 8 <= room)
+	{
+		for (size_t i = 0; i < length; i += 8)
+			memcpy(op + i, from + i, 8);
+	}
+	else
+	{
+		for (size_t i = 0; i < length; i++)
+			op[i] = from[i];
+	}
+}
+
+size_t lz4_compress_bound(size_t srcSize)
+{
+	return srcSize + srcSize / 255 + 16;
+}
+
+size_t lz4_compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity)
+{
+	uint32_t table[1 << LZ4_HASH_LOG]; // last position of each hashed 4 byte sequence
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* const iend = src + srcSize;
+	const uint8_t* const mflimit = srcSize > LZ4_MF_LIMIT ? iend - LZ4_MF_LIMIT : src;
+	const uint8_t* const matchlimit = iend - std::min<size_t>(srcSize, LZ4_LAST_LITERALS);
+	uint8_t* op = dst;
+	uint8_t* const oend = dst + dstCapacity;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip < mflimit)
+	{
+		const uint32_t sequence = read32(ip);
+		const uint32_t h = hashSequence(sequence);
+		const uint8_t* match = src + table[h];
+
+		table[h] = uint32_t(ip - src);
+
+		if (match >= ip || ip - match > LZ4_MAX_DISTANCE || read32(match) != sequence)
+		{
+			// Step further the longer we go without a match, incompressible data passes quickly
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		while (ip > anchor && match > src && ip[-1] == match[-1])
+		{
+			ip--;
+			match--;
+		}
+
+		const uint8_t* matchEnd = ip + LZ4_MIN_MATCH;
+		const uint8_t* from = match + LZ4_MIN_MATCH;
+
+		while (matchEnd < matchlimit && *matchEnd == *from)
+		{
+			matchEnd++;
+			from++;
+		}
+
+		const size_t literals = ip - anchor;
+		const size_t matchLength = matchEnd - ip - LZ4_MIN_MATCH;
+		const size_t distance = ip - match;
+
+		if (size_t(oend - op) < 1 + lengthBytes(literals) + literals + 2 + lengthBytes(matchLength))
+			return 0;
+
+		*op++ = uint8_t((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(matchLength, 15));
+		op = writeLength(op, literals);
+		memcpy(op, anchor, literals);
+		op += literals;
+		*op++ = uint8_t(distance);
+		*op++ = uint8_t(distance >> 8);
+		op = writeLength(op, matchLength);
+
+		// Remember a position near the end of the match, repeats often continue from there
+		table[hashSequence(read32(matchEnd - 2))] = uint32_t(matchEnd - 2 - src);
+
+		ip = anchor = matchEnd;
+	}
+
+	const size_t literals = iend - anchor;
+
+	if (size_t(oend - op) < 1 + lengthBytes(literals) + literals)
+		return 0;
+
+	*op++ = uint8_t(std::min<size_t>(literals, 15) << 4);
+	op = writeLength(op, literals);
+	memcpy(op, anchor, literals);
+	op += literals;
+
+	return op - dst;
+}
+
+int64_t lz4_decode(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize)
+{
+	const uint8_t* ip = src;
+	const uint8_t* const iend = src + srcSize;
+	uint8_t* op = dst;
+	uint8_t* const oend = dst + dstSize;
+
+	while (ip < iend)
+	{
+		const uint8_t token = *ip++;
+		size_t literals = token >> 4;
+		size_t matchLength = token & 15;
+		size_t distance;
+
+		if (literals == 15 && !readLength(ip, iend, literals))
+			return -1;
+
+		if (size_t(iend - ip) < literals || size_t(oend - op) < literals)
+			return -1;
+
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		// The last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+
+		distance = ip[0] | (size_t(ip[1]) << 8);
+		ip += 2;
+
+		if (distance == 0 || distance > size_t(op - dst))
+			return -1;
+
+		if (matchLength == 15 && !readLength(ip, iend, matchLength))
+			return -1;
+		matchLength += LZ4_MIN_MATCH;
+
+		if (size_t(oend - op) < matchLength)
+			return -1;
+
+		copyMatch(op, distance, matchLength, oend - op);
+		op += matchLength;
+	}
+
+	return op - dst;
+}
@@ -0,0 +1,17 @@
+#ifndef LZ4_H
+#define LZ4_H
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest output lz4_compress() can produce for srcSize bytes of input.
+size_t lz4_compress_bound(size_t srcSize);
+
+// Compresses src into a raw LZ4 block (no frame header).
+// Returns the compressed size, or 0 if it doesn't fit into dstCapacity.
+size_t lz4_compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity);
+
+// Decodes a raw LZ4 block.
+// Returns the number of bytes written into dst, or -1 if the block is invalid or doesn't fit into dst.
+int64_t lz4_decode(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize);
+
+#endif
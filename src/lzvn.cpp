@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <cstring>
+#include <algorithm>
+#include "lzvn.h"
+
+/* Opcodes (first byte), L = literal count, M = match length, D = match distance
+ * sml_d  LLMMMDDD DDDDDDDD               L 0-3, M 3-10, D < 2048
+ * med_d  101LLMMM DDDDDDMM DDDDDDDD      L 0-3, M 3-34, D < 16384
+ * lrg_d  LLMMM111 DDDDDDDD DDDDDDDD      L 0-3, M 3-10, D < 65536
+ * pre_d  LLMMM110                        L 0-3, M 3-10, previous D
+ * sml_m  1111MMMM                        M 1-15, previous D
+ * lrg_m  11110000 MMMMMMMM               M 16-271, previous D
+ * sml_l  1110LLLL                        L 1-15
+ * lrg_l  11100000 LLLLLLLL               L 16-271
+ * eos    0x06 (followed by 7 bytes of padding), nop 0x0E, 0x16
+ * 0x1E-0x3E (xxxxx110), 0x70-0x7F and 0xD0-0xDF are undefined.
+ * Literals follow the opcode, the match is copied after them.
+ */
+
+// Copies a match which may overlap with its destination
+static inline void copyMatch(uint8_t* op, size_t distance, size_t length, size_t room)
+{
+	const uint8_t* from = op - distance;
+	
+	// Wide copies when 8 byte steps can't overlap and there's room to overshoot
+	if (distance >= 8 && length + 8 <= room)
+	{
+		for (size_t i = 0; i < length; i += 8)
+			memcpy(op + i, from + i, 8);
+	}
+	else
+	{
+		for (size_t i = 0; i < length; i++)
+			op[i] = from[i];
+	}
+}
+
+int64_t lzvn_decode(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize)
+{
+	const uint8_t* ip = src;
+	const uint8_t* const iend = src + srcSize;
+	uint8_t* op = dst;
+	uint8_t* const oend = dst + dstSize;
+	size_t distance = 0;
+	
+	while (ip < iend && op < oend)
+	{
+		const uint8_t opc = ip[0];
+		size_t opLen, literals = 0, match = 0;
+		
+		if (opc >= 0xF0)
+		{
+			// sml_m, lrg_m
+			if (opc == 0xF0)
+			{
+				if (iend - ip < 2)
+					return -1;
+				match = ip[1] + 16;
+				opLen = 2;
+			}
+			else
+			{
+				match = opc & 0xF;
+				opLen = 1;
+			}
+		}
+		else if (opc >= 0xE0)
+		{
+			// sml_l, lrg_l
+			if (opc == 0xE0)
+			{
+				if (iend - ip < 2)
+					return -1;
+				literals = ip[1] + 16;
+				opLen = 2;
+			}
+			else
+			{
+				literals = opc & 0xF;
+				opLen = 1;
+			}
+		}
+		else if (opc >= 0xD0 || (opc >= 0x70 && opc < 0x80))
+			return -1;
+		else if (opc >= 0xA0 && opc < 0xC0)
+		{
+			// med_d
+			if (iend - ip < 3)
+				return -1;
+			literals = (opc >> 3) & 3;
+			match = (((opc & 7) << 2) | (ip[1] & 3)) + 3;
+			distance = (size_t(ip[2]) << 6) | (ip[1] >> 2);
+			opLen = 3;
+		}
+		else
+		{
+			literals = opc >> 6;
+			match = ((opc >> 3) & 7) + 3;
+			
+			switch (opc & 7)
+			{
+				case 6: // pre_d, eos, nop
+					if (opc == 0x06)
+						return op - dst;
+					if (opc == 0x0E || opc == 0x16)
+						literals = match = 0;
+					else if (opc < 0x40)
+						return -1;
+					opLen = 1;
+					break;
+				case 7: // lrg_d
+					if (iend - ip < 3)
+						return -1;
+					distance = ip[1] | (size_t(ip[2]) << 8);
+					opLen = 3;
+					break;
+				default: // sml_d
+					if (iend - ip < 2)
+						return -1;
+					distance = (size_t(opc & 7) << 8) | ip[1];
+					opLen = 2;
+			}
+		}
+		
+		ip += opLen;
+		
+		if (literals)
+		{
+			if (size_t(iend - ip) < literals)
+				return -1;
+			
+			const size_t count = std::min<size_t>(literals, oend - op);
+			memcpy(op, ip, count);
+			op += count;
+			ip += literals;
+		}
+		
+		if (match && op < oend)
+		{
+			if (distance == 0 || distance > size_t(op - dst))
+				return -1;
+			
+			const size_t count = std::min<size_t>(match, oend - op);
+			copyMatch(op, distance, count, oend - op);
+			op += count;
+		}
+	}
+	
+	return op - dst;
+}
@@ -0,0 +1,11 @@
+#ifndef LZVN_H
+#define LZVN_H
+#include <stdint.h>
+#include <stddef.h>
+
+// Decodes a raw LZVN stream (as stored in decmpfs chunks, i.e. without any block header).
+// Stops at the end-of-stream opcode or once dst is full.
+// Returns the number of bytes written into dst, or -1 if the stream is invalid.
+int64_t lzvn_decode(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize);
+
+#endif
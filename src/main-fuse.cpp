@@ -7,21 +7,43 @@
 #include <stdexcept>
 #include <limits>
 #include <functional>
+#include <vector>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "HFSVolume.h"
 #include "AppleDisk.h"
 #include "GPTDisk.h"
 #include "DMGDisk.h"
 #include "FileReader.h"
+#include "MmapReader.h"
 #include "CachedReader.h"
+#include "DiskRunCache.h"
+#include "SharedRunCache.h"
+#include "ThreadPool.h"
 #include "exceptions.h"
 #include "HFSHighLevelVolume.h"
 #ifdef DARLING
 #	include "stat_xlate.h"
+#else
+#	include "MountDaemon.h"
 #endif
 
-std::shared_ptr<Reader> g_fileReader;
-std::unique_ptr<HFSHighLevelVolume> g_volume;
-std::unique_ptr<PartitionedDisk> g_partitions;
+MountedImage g_mount;
+static bool g_warmUp = false;
+
+static const char CACHE_DIR_OPTION[] = "--cache-dir=";
+static const char CACHE_SIZE_OPTION[] = "--cache-size=";
+static const char SHARED_CACHE_OPTION[] = "--shared-cache=";
+static const char SHARED_CACHE_DIR_OPTION[] = "--shared-cache-dir=";
+static const char WARM_UP_OPTION[] = "--warm-up";
+static const uint64_t DEFAULT_CACHE_SIZE_MB = 1024;
+#ifndef DARLING
+static const char DAEMON_OPTION[] = "--daemon=";
+static const char CONTROL_OPTION[] = "--control=";
+static const char MEMORY_OPTION[] = "--memory=";
+#endif
 
 int main(int argc, const char** argv)
 {
@@ -29,27 +51,83 @@ int main(int argc, const char** argv)
 	{
 		struct fuse_operations ops;
 		struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+		std::vector<const char*> fuseArgv;
+		std::shared_ptr<DiskRunCache> runCache;
+		const char* cacheDir = nullptr;
+		const char* sharedCacheDir = nullptr;
+		uint64_t cacheSizeMB = DEFAULT_CACHE_SIZE_MB, sharedCacheMB = 0;
+#ifndef DARLING
+		const char* daemonSocket = nullptr;
+		const char* controlSocket = nullptr;
+		uint64_t memoryMB = 0;
+#endif
+		
+		// Our own options don't go to FUSE
+		for (int i = 0; i < argc; i++)
+		{
+			if (strncmp(argv[i], CACHE_DIR_OPTION, sizeof(CACHE_DIR_OPTION) - 1) == 0)
+				cacheDir = argv[i] + sizeof(CACHE_DIR_OPTION) - 1;
+			else if (strncmp(argv[i], CACHE_SIZE_OPTION, sizeof(CACHE_SIZE_OPTION) - 1) == 0)
+				cacheSizeMB = strtoull(argv[i] + sizeof(CACHE_SIZE_OPTION) - 1, nullptr, 10);
+			else if (strncmp(argv[i], SHARED_CACHE_OPTION, sizeof(SHARED_CACHE_OPTION) - 1) == 0)
+				sharedCacheMB = strtoull(argv[i] + sizeof(SHARED_CACHE_OPTION) - 1, nullptr, 10);
+			else if (strncmp(argv[i], SHARED_CACHE_DIR_OPTION, sizeof(SHARED_CACHE_DIR_OPTION) - 1) == 0)
+				sharedCacheDir = argv[i] + sizeof(SHARED_CACHE_DIR_OPTION) - 1;
+			else if (strcmp(argv[i], WARM_UP_OPTION) == 0)
+				g_warmUp = true;
+#ifndef DARLING
+			else if (strncmp(argv[i], DAEMON_OPTION, sizeof(DAEMON_OPTION) - 1) == 0)
+				daemonSocket = argv[i] + sizeof(DAEMON_OPTION) - 1;
+			else if (strncmp(argv[i], CONTROL_OPTION, sizeof(CONTROL_OPTION) - 1) == 0)
+				controlSocket = argv[i] + sizeof(CONTROL_OPTION) - 1;
+			else if (strncmp(argv[i], MEMORY_OPTION, sizeof(MEMORY_OPTION) - 1) == 0)
+				memoryMB = strtoull(argv[i] + sizeof(MEMORY_OPTION) - 1, nullptr, 10);
+#endif
+			else
+				fuseArgv.push_back(argv[i]);
+		}
+		
+		argc = fuseArgv.size();
+		argv = fuseArgv.data();
+		
+#ifndef DARLING
+		if (controlSocket != nullptr)
+			return MountDaemon::control(controlSocket, std::vector<std::string>(argv + 1, argv + argc));
+#endif
 	
-		if (argc < 3)
+		if (argc < 3
+#ifndef DARLING
+			&& daemonSocket == nullptr
+#endif
+			)
 		{
 			showHelp(argv[0]);
 			return 1;
 		}
+		
+		if (cacheDir != nullptr && *cacheDir)
+			runCache = std::make_shared<DiskRunCache>(cacheDir, cacheSizeMB * 1024 * 1024);
+		
+		SharedRunCache::instance()->setLimit(sharedCacheMB * 1024 * 1024);
+		if (sharedCacheDir != nullptr && *sharedCacheDir)
+			SharedRunCache::instance()->setBacking(std::make_shared<DiskRunCache>(sharedCacheDir, cacheSizeMB * 1024 * 1024));
+		
+#ifndef DARLING
+		if (daemonSocket != nullptr)
+		{
+			MountDaemon daemon(daemonSocket, memoryMB * 1024 * 1024, runCache);
+			
+			daemon.run();
+			return 0;
+		}
+#endif
+		
+		// fuse_main() (and daemon() with Darling) forks into the background, which leaves
+		// any worker threads behind. The pools start theirs once hfs_init() allows them.
+		ThreadPool::setThreadsAllowed(false);
 	
-		openDisk(argv[1]);
-	
-		memset(&ops, 0, sizeof(ops));
-	
-		ops.getattr = hfs_getattr;
-		ops.open = hfs_open;
-		ops.read = hfs_read;
-		ops.release = hfs_release;
-		//ops.opendir = hfs_opendir;
-		ops.readdir = hfs_readdir;
-		ops.readlink = hfs_readlink;
-		//ops.releasedir = hfs_releasedir;
-		ops.getxattr = hfs_getxattr;
-		ops.listxattr = hfs_listxattr;
+		openDisk(g_mount, argv[1], runCache);
+		fillOperations(ops);
 	
 		for (int i = 0; i < argc; i++)
 		{
@@ -67,7 +145,7 @@ int main(int argc, const char** argv)
 		BEFORE_MOUNT_EXTRA;
 #endif
 
-		return fuse_main(args.argc, args.argv, &ops, 0);
+		return fuse_main(args.argc, args.argv, &ops, &g_mount);
 	}
 	catch (const std::exception& e)
 	{
@@ -85,33 +163,52 @@ int main(int argc, const char** argv)
 
 void showHelp(const char* argv0)
 {
-	std::cerr << "Usage: " << argv0 << " <file> <mount-point> [fuse args]\n\n";
+	std::cerr << "Usage: " << argv0 << " <file> <mount-point> [--cache-dir=<dir>] [--cache-size=<MB>]"
+		" [--shared-cache=<MB>] [--shared-cache-dir=<dir>] [--warm-up] [fuse args]\n\n";
 	std::cerr << ".DMG files and raw disk images can be mounted.\n";
 	std::cerr << argv0 << " automatically selects the first HFS+/HFSX partition.\n";
+	std::cerr << "--cache-dir keeps decompressed DMG data in the given directory across mounts, up to --cache-size (default "
+		<< DEFAULT_CACHE_SIZE_MB << " MB).\n";
+	std::cerr << "--shared-cache keeps decompressed data by content, for images with data in common, "
+		"--shared-cache-dir shares it with other processes (use a directory in /dev/shm).\n";
+	std::cerr << "--warm-up reads the catalog into memory in the background, speeding up the first walk over the volume.\n";
+#ifndef DARLING
+	std::cerr << "\nDaemon mode: " << argv0 << " --daemon=<socket> [--memory=<MB>] [cache options]\n";
+	std::cerr << "serves any number of images, controlled with " << argv0 << " --control=<socket> <command>:\n";
+	std::cerr << "  mount <file> <mount-point>, unmount <mount-point>, list, stats, shutdown\n";
+	std::cerr << "--memory splits the given amount of cache memory between all images.\n";
+#endif
 }
 
 
-void openDisk(const char* path)
+void openDisk(MountedImage& mount, const char* path, std::shared_ptr<DiskRunCache> runCache)
 {
 	int partIndex = -1;
-	std::shared_ptr<HFSVolume> volume;
-
-	g_fileReader.reset(new FileReader(path));
-
-	if (DMGDisk::isDMG(g_fileReader))
-		g_partitions.reset(new DMGDisk(g_fileReader));
-	else if (GPTDisk::isGPTDisk(g_fileReader))
-		g_partitions.reset(new GPTDisk(g_fileReader));
-	else if (AppleDisk::isAppleDisk(g_fileReader))
-		g_partitions.reset(new AppleDisk(g_fileReader));
-	else if (HFSVolume::isHFSPlus(g_fileReader))
-		volume.reset(new HFSVolume(g_fileReader));
+
+	try
+	{
+		mount.fileReader.reset(new MmapReader(path));
+	}
+	catch (const io_error&)
+	{
+		// e.g. block devices, images on network file systems or an address space too small for the image
+		mount.fileReader.reset(new FileReader(path));
+	}
+
+	if (DMGDisk::isDMG(mount.fileReader))
+		mount.partitions.reset(new DMGDisk(mount.fileReader, runCache));
+	else if (GPTDisk::isGPTDisk(mount.fileReader))
+		mount.partitions.reset(new GPTDisk(mount.fileReader));
+	else if (AppleDisk::isAppleDisk(mount.fileReader))
+		mount.partitions.reset(new AppleDisk(mount.fileReader));
+	else if (HFSVolume::isHFSPlus(mount.fileReader))
+		mount.volume.reset(new HFSVolume(mount.fileReader));
 	else
 		throw function_not_implemented_error("Unsupported file format");
 
-	if (g_partitions)
+	if (mount.partitions)
 	{
-		const std::vector<PartitionedDisk::Partition>& parts = g_partitions->partitions();
+		const std::vector<PartitionedDisk::Partition>& parts = mount.partitions->partitions();
 
 		for (size_t i = 0; i < parts.size(); i++)
 		{
@@ -128,10 +225,81 @@ void openDisk(const char* path)
 		if (partIndex == -1)
 			throw function_not_implemented_error("No suitable partition found in file");
 
-		volume.reset(new HFSVolume(g_partitions->readerForPartition(partIndex)));
+		mount.volume.reset(new HFSVolume(mount.partitions->readerForPartition(partIndex)));
 	}
 	
-	g_volume.reset(new HFSHighLevelVolume(volume));
+	mount.highLevelVolume.reset(new HFSHighLevelVolume(mount.volume));
+}
+
+void fillOperations(struct fuse_operations& ops)
+{
+	memset(&ops, 0, sizeof(ops));
+
+	ops.init = hfs_init;
+	ops.destroy = hfs_destroy;
+	ops.getattr = hfs_getattr;
+	ops.open = hfs_open;
+	ops.read = hfs_read;
+	ops.release = hfs_release;
+	//ops.opendir = hfs_opendir;
+	ops.readdir = hfs_readdir;
+	ops.readlink = hfs_readlink;
+	//ops.releasedir = hfs_releasedir;
+	ops.getxattr = hfs_getxattr;
+	ops.listxattr = hfs_listxattr;
+}
+
+static MountedImage* currentMount()
+{
+	return static_cast<MountedImage*>(fuse_get_context()->private_data);
+}
+
+MountedImage::~MountedImage()
+{
+	finishWarmUp(*this);
+}
+
+void finishWarmUp(MountedImage& mount)
+{
+	mount.stopWarmUp = true;
+	if (mount.warmUp.joinable())
+		mount.warmUp.join();
+}
+
+void* hfs_init(struct fuse_conn_info* conn)
+{
+	MountedImage* mount = currentMount();
+
+	// Not any earlier, FUSE may have forked into the background and threads don't survive that
+	ThreadPool::setThreadsAllowed(true);
+
+	if (g_warmUp && !mount->warmUp.joinable())
+	{
+		mount->warmUp = std::thread([mount]() {
+#ifdef __linux__
+			// The nice value is per thread on Linux, requests keep their priority
+			setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+			try
+			{
+				mount->volume->warmUpBtrees(mount->mutex, mount->stopWarmUp);
+			}
+			catch (const std::exception& e)
+			{
+				// Nothing lost, the nodes are read when needed
+				std::cerr << "B-tree warm-up failed: " << e.what() << std::endl;
+			}
+		});
+	}
+
+	return mount;
+}
+
+void hfs_destroy(void* privateData)
+{
+	// Still within fuse_main(), the thread pools and caches the warm-up uses are static
+	// objects and gone by the time g_mount is destroyed
+	finishWarmUp(*static_cast<MountedImage*>(privateData));
 }
 
 int handle_exceptions(std::function<int()> func)
@@ -184,13 +352,16 @@ int handle_exceptions(std::function<int()> func)
 
 int hfs_getattr(const char* path, struct stat* stat)
 {
+	MountedImage* mount = currentMount();
+	std::lock_guard<std::mutex> lock(mount->mutex);
+
 	std::cerr << "hfs_getattr(" << path << ")\n";
 
 	return handle_exceptions([&]() {
 #ifndef DARLING
-		*stat = g_volume->stat(path);
+		*stat = mount->highLevelVolume->stat(path);
 #else
-		struct stat st = g_volume->stat(path);
+		struct stat st = mount->highLevelVolume->stat(path);
 		bsd_stat_to_linux_stat(&st, reinterpret_cast<linux_stat*>(stat));
 #endif
 		return 0;
@@ -199,6 +370,9 @@ int hfs_getattr(const char* path, struct stat* stat)
 
 int hfs_readlink(const char* path, char* buf, size_t size)
 {
+	MountedImage* mount = currentMount();
+	std::lock_guard<std::mutex> lock(mount->mutex);
+
 	std::cerr << "hfs_readlink(" << path << ")\n";
 
 	return handle_exceptions([&]() {
@@ -206,7 +380,7 @@ int hfs_readlink(const char* path, char* buf, size_t size)
 		std::shared_ptr<Reader> file;
 		size_t rd;
 
-		file = g_volume->openFile(path);
+		file = mount->highLevelVolume->openFile(path);
 		rd = file->read(buf, size-1, 0);
 		
 		buf[rd] = '\0';
@@ -216,6 +390,9 @@ int hfs_readlink(const char* path, char* buf, size_t size)
 
 int hfs_open(const char* path, struct fuse_file_info* info)
 {
+	MountedImage* mount = currentMount();
+	std::lock_guard<std::mutex> lock(mount->mutex);
+
 	std::cerr << "hfs_open(" << path << ")\n";
 
 	return handle_exceptions([&]() {
@@ -223,7 +400,7 @@ int hfs_open(const char* path, struct fuse_file_info* info)
 		std::shared_ptr<Reader> file;
 		std::shared_ptr<Reader>* fh;
 
-		file = g_volume->openFile(path);
+		file = mount->highLevelVolume->openFile(path);
 		fh = new std::shared_ptr<Reader>(file);
 
 		info->fh = uint64_t(fh);
@@ -233,6 +410,9 @@ int hfs_open(const char* path, struct fuse_file_info* info)
 
 int hfs_read(const char* path, char* buf, size_t bytes, off_t offset, struct fuse_file_info* info)
 {
+	MountedImage* mount = currentMount();
+	std::lock_guard<std::mutex> lock(mount->mutex);
+
 	return handle_exceptions([&]() {
 		if (!info->fh)
 			return -EIO;
@@ -244,7 +424,10 @@ int hfs_read(const char* path, char* buf, size_t bytes, off_t offset, struct fus
 
 int hfs_release(const char* path, struct fuse_file_info* info)
 {
-	// std::cout << "File cache zone: hit rate: " << g_volume->getFileZone()->hitRate() << ", size: " << g_volume->getFileZone()->size() << " blocks\n";
+	MountedImage* mount = currentMount();
+	std::lock_guard<std::mutex> lock(mount->mutex);
+
+	// std::cout << "File cache zone: hit rate: " << mount->highLevelVolume->getFileZone()->hitRate() << ", size: " << mount->highLevelVolume->getFileZone()->size() << " blocks\n";
 
 	return handle_exceptions([&]() {
 
@@ -252,24 +435,25 @@ int hfs_release(const char* path, struct fuse_file_info* info)
 		delete file;
 		info->fh = 0;
 		
+		mount->highLevelVolume->closeFile();
+		
 		return 0;
 	});
 }
 
 int hfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* info)
 {
+	MountedImage* mount = currentMount();
+	std::lock_guard<std::mutex> lock(mount->mutex);
+
 	std::cerr << "hfs_readdir(" << path << ")\n";
 
 	return handle_exceptions([&]() {
-		std::map<std::string, struct stat> contents;
-
-		contents = g_volume->listDirectory(path);
-
-		for (auto it = contents.begin(); it != contents.end(); it++)
-		{
-			if (filler(buf, it->first.c_str(), &it->second, 0) != 0)
-				return -ENOMEM;
-		}
+		// Entries are passed with the offset of the entry that follows them. Once filler() reports a full buffer,
+		// the kernel calls us again with that offset and the listing resumes from there.
+		mount->highLevelVolume->listDirectory(path, offset, [&](const std::string& name, const struct stat& st, uint64_t nextCookie) {
+			return filler(buf, name.c_str(), &st, nextCookie) == 0;
+		});
 
 		return 0;
 	});
@@ -282,6 +466,9 @@ int hfs_getxattr(const char* path, const char* name, char* value, size_t vlen, u
 int hfs_getxattr(const char* path, const char* name, char* value, size_t vlen)
 #endif
 {
+	MountedImage* mount = currentMount();
+	std::lock_guard<std::mutex> lock(mount->mutex);
+
 	std::cerr << "hfs_getxattr(" << path << ", " << name << ")\n";
 #if defined(__APPLE__) && !defined(DARLING)
 	if (position > 0) return -ENOSYS; // it's not supported... yet. I think it doesn't happen anymore since osx use less ressource fork
@@ -290,7 +477,7 @@ int hfs_getxattr(const char* path, const char* name, char* value, size_t vlen)
 	return handle_exceptions([&]() -> int {
 		std::vector<uint8_t> data;
 
-		data = g_volume->getXattr(path, name);
+		data = mount->highLevelVolume->getXattr(path, name);
 
 		if (value == nullptr)
 			return data.size();
@@ -305,11 +492,14 @@ int hfs_getxattr(const char* path, const char* name, char* value, size_t vlen)
 
 int hfs_listxattr(const char* path, char* buffer, size_t size)
 {
+	MountedImage* mount = currentMount();
+	std::lock_guard<std::mutex> lock(mount->mutex);
+
 	return handle_exceptions([&]() -> int {
 		std::vector<std::string> attrs;
 		std::vector<char> output;
 
-		attrs = g_volume->listXattr(path);
+		attrs = mount->highLevelVolume->listXattr(path);
 
 		for (const std::string& str : attrs)
 			output.insert(output.end(), str.c_str(), str.c_str() + str.length() + 1);
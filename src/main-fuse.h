@@ -3,9 +3,45 @@
 #define FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include "Reader.h"
+#include "PartitionedDisk.h"
+#include "HFSVolume.h"
+#include "HFSHighLevelVolume.h"
+
+class DiskRunCache;
+
+// Everything kept for an image being served, FUSE gets it as private data
+struct MountedImage
+{
+	std::shared_ptr<Reader> fileReader;
+	std::unique_ptr<PartitionedDisk> partitions;
+	// Declared after partitions, so that they are destroyed before the cache zones of the disk
+	std::shared_ptr<HFSVolume> volume;
+	std::unique_ptr<HFSHighLevelVolume> highLevelVolume;
+	
+	// Held while handling a request, others (the daemon, the warm-up) take it to touch the image's cache zones
+	std::mutex mutex;
+	
+	// Fills the B-tree cache in the background once FUSE is running, see HFSVolume::warmUpBtrees()
+	std::thread warmUp;
+	std::atomic<bool> stopWarmUp { false };
+	
+	~MountedImage();
+};
 
 static void showHelp(const char* argv0);
-static void openDisk(const char* path);
+void openDisk(MountedImage& mount, const char* path, std::shared_ptr<DiskRunCache> runCache);
+void fillOperations(struct fuse_operations& ops);
+
+// Stops the warm-up thread and waits for it, before the image or anything it uses goes away
+void finishWarmUp(MountedImage& mount);
+
+void* hfs_init(struct fuse_conn_info* conn);
+void hfs_destroy(void* privateData);
 
 int hfs_getattr(const char* path, struct stat* stat);
 int hfs_readlink(const char* path, char* buf, size_t size);
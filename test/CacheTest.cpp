@@ -1,9 +1,11 @@
 #include "../src/CacheZone.h"
 #include "../src/CachedReader.h"
 #include "../src/MemoryReader.h"
+#include "../src/exceptions.h"
 #include <memory>
 #include <random>
 #include <array>
+#include <algorithm>
 #include <iostream>
 #include "CacheTest.h"
 
@@ -14,10 +16,10 @@ static void generateRandomData(std::vector<uint8_t>& testData);
 
 BOOST_AUTO_TEST_CASE(CacheTest)
 {
+	CacheZone zone(50); // must outlive cachedReader
 	std::shared_ptr<MyMemoryReader> memoryReader;
 	std::unique_ptr<CachedReader> cachedReader;
 	std::vector<uint8_t> testData;
-	CacheZone zone(50);
 
 	// Generate 20000 bytes of random data
 	generateRandomData(testData);
@@ -49,6 +51,172 @@ BOOST_AUTO_TEST_CASE(CacheTest)
 	BOOST_CHECK_EQUAL(zone.size(), 5);
 }
 
+BOOST_AUTO_TEST_CASE(CacheLargeBlockTest)
+{
+	CacheZone zone(50, 16384);
+	std::shared_ptr<MyMemoryReader> memoryReader;
+	std::unique_ptr<CachedReader> cachedReader;
+	std::vector<uint8_t> testData;
+
+	generateRandomData(testData);
+
+	memoryReader.reset(new MyMemoryReader(&testData[0], testData.size()));
+
+	// Boundaries not aligned to the cache block, so blocks fill in pieces
+	memoryReader->setOptimalBoundaries({ 5000, 9000, 17000 });
+
+	cachedReader.reset(new CachedReader(memoryReader, &zone, "MyMemoryReader"));
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int i = 0; i < 20000; i += 500)
+		{
+			std::array<uint8_t, 500> buf;
+
+			cachedReader->read(buf.begin(), buf.size(), i);
+			BOOST_CHECK(std::equal(buf.begin(), buf.end(), &testData[i]));
+		}
+	}
+
+	// 20000 bytes fit in 2 blocks of 16 KiB
+	BOOST_CHECK_EQUAL(zone.size(), 2);
+	BOOST_CHECK(zone.hitRate() > 0.5);
+
+	BOOST_CHECK_THROW(zone.setBlockSize(3000), std::logic_error);
+	zone.setBlockSize(4096);
+	BOOST_CHECK_EQUAL(zone.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(CacheTagTest)
+{
+	CacheZone zone(10);
+	std::array<uint8_t, CacheZone::BLOCK_SIZE> block;
+	CacheZone::TagId a, b;
+
+	block.fill(0xaa);
+
+	a = zone.acquireTag("/some/file");
+	b = zone.acquireTag("/other/file");
+
+	BOOST_CHECK(a != b);
+	BOOST_CHECK_EQUAL(zone.acquireTag("/some/file"), a);
+
+	for (int i = 0; i < 3; i++)
+	{
+		zone.store(a, i, block.data(), 0, block.size());
+		zone.store(b, i, block.data(), 0, block.size());
+	}
+
+	// Storing the same block again doesn't add another one
+	zone.store(a, 0, block.data(), 0, block.size());
+	BOOST_CHECK_EQUAL(zone.size(), 6);
+
+	zone.invalidate(a);
+
+	BOOST_CHECK_EQUAL(zone.size(), 3);
+	BOOST_CHECK(!zone.contains(a, 0, 1));
+	BOOST_CHECK(zone.contains(b, 0, 1));
+
+	// Eviction keeps to the limit across tags
+	for (int i = 3; i < 20; i++)
+		zone.store(b, i, block.data(), 0, block.size());
+
+	BOOST_CHECK_EQUAL(zone.size(), 10);
+	BOOST_CHECK(!zone.contains(b, 0, 1));
+	BOOST_CHECK(zone.contains(b, 19 * block.size(), block.size()));
+
+	zone.releaseTag(a);
+	zone.releaseTag(a);
+	zone.releaseTag(b);
+}
+
+BOOST_AUTO_TEST_CASE(CacheCompressedTest)
+{
+	CacheZone zone(2);
+	std::array<uint8_t, CacheZone::BLOCK_SIZE> block, out;
+	CacheZone::TagId tag = zone.acquireTag("compressed");
+	std::vector<CacheZone::Range> missing;
+
+	zone.setCompressedLimit(1024*1024);
+
+	for (int i = 0; i < 10; i++)
+	{
+		block.fill(i);
+		zone.store(tag, i, block.data(), 0, block.size());
+	}
+
+	// Evicted blocks went to the compressed tier
+	BOOST_CHECK_EQUAL(zone.size(), 2);
+	BOOST_CHECK_EQUAL(zone.compressedSize(), 8);
+	BOOST_CHECK(zone.contains(tag, 0, 10 * block.size()));
+
+	BOOST_CHECK_EQUAL(zone.getRange(tag, 3 * block.size(), block.size(), out.data(), missing), block.size());
+	BOOST_CHECK(missing.empty());
+	BOOST_CHECK(std::all_of(out.begin(), out.end(), [](uint8_t b) { return b == 3; }));
+	BOOST_CHECK_EQUAL(zone.size(), 2);
+	BOOST_CHECK_EQUAL(zone.compressedSize(), 8);
+
+	// The compressed tier has its own limit
+	zone.setCompressedLimit(1);
+	BOOST_CHECK_EQUAL(zone.compressedSize(), 0);
+	BOOST_CHECK(!zone.contains(tag, 0, 1));
+
+	zone.invalidate(tag);
+	BOOST_CHECK_EQUAL(zone.size(), 0);
+	zone.releaseTag(tag);
+}
+
+BOOST_AUTO_TEST_CASE(CacheReadAheadTest)
+{
+	CacheZone zone(50);
+	std::shared_ptr<MyMemoryReader> memoryReader;
+	std::vector<uint8_t> testData;
+	std::array<uint8_t, 500> buf;
+
+	generateRandomData(testData);
+	memoryReader.reset(new MyMemoryReader(&testData[0], testData.size()));
+	memoryReader->setOptimalBoundaries({ 4096, 2*4096, 3*4096, 4*4096 });
+
+	// Random access reads nothing but the blocks it asks for
+	{
+		CachedReader cachedReader(memoryReader, &zone, "random");
+		CacheZone::TagId tag = zone.acquireTag("random");
+
+		cachedReader.read(buf.begin(), buf.size(), 10000);
+		cachedReader.read(buf.begin(), buf.size(), 3000);
+		BOOST_CHECK(std::equal(buf.begin(), buf.end(), &testData[3000]));
+		BOOST_CHECK(!zone.contains(tag, 4096, 1));
+		BOOST_CHECK(!zone.contains(tag, 3*4096, 1));
+		zone.releaseTag(tag);
+	}
+
+	// A sequential stream gets the rest of the data read ahead
+	{
+		CachedReader cachedReader(memoryReader, &zone, "sequential");
+		CacheZone::TagId tag = zone.acquireTag("sequential");
+
+		// The first read alone is no stream yet
+		cachedReader.read(buf.begin(), buf.size(), 0);
+		BOOST_CHECK(std::equal(buf.begin(), buf.end(), &testData[0]));
+		BOOST_CHECK(!zone.contains(tag, 4096, 1));
+
+		cachedReader.read(buf.begin(), buf.size(), buf.size());
+		BOOST_CHECK(std::equal(buf.begin(), buf.end(), &testData[buf.size()]));
+		BOOST_CHECK(zone.contains(tag, 0, testData.size()));
+		zone.releaseTag(tag);
+	}
+
+	// Failing to read ahead doesn't fail the read
+	{
+		std::shared_ptr<TruncatedReader> truncated(new TruncatedReader(&testData[0], testData.size(), 8192));
+		CachedReader cachedReader(truncated, &zone, "truncated");
+
+		BOOST_CHECK_EQUAL(cachedReader.read(buf.begin(), buf.size(), 0), buf.size());
+		BOOST_CHECK_EQUAL(cachedReader.read(buf.begin(), buf.size(), buf.size()), buf.size());
+		BOOST_CHECK(std::equal(buf.begin(), buf.end(), &testData[buf.size()]));
+	}
+}
+
 static void generateRandomData(std::vector<uint8_t>& randomData)
 {
 	std::random_device rd;
@@ -61,6 +229,14 @@ static void generateRandomData(std::vector<uint8_t>& randomData)
 		randomData.push_back(dis(gen));
 }
 
+int32_t TruncatedReader::read(void* buf, int32_t count, uint64_t offset)
+{
+	if (offset + count > m_validLength)
+		throw io_error("Read past the end of valid data");
+
+	return MemoryReader::read(buf, count, offset);
+}
+
 void MyMemoryReader::setOptimalBoundaries(std::initializer_list<uint64_t> bd)
 {
 	m_optimalBoundaries.assign(bd);
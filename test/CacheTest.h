@@ -16,5 +16,18 @@ private:
 	std::list<uint64_t> m_optimalBoundaries;
 };
 
+// Fails reads reaching past a given offset
+class TruncatedReader : public MemoryReader
+{
+public:
+	TruncatedReader(const uint8_t* start, size_t length, uint64_t validLength)
+	: MemoryReader(start, length), m_validLength(validLength) {}
+
+	virtual int32_t read(void* buf, int32_t count, uint64_t offset) override;
+
+private:
+	uint64_t m_validLength;
+};
+
 #endif // CACHETEST_H
 
@@ -0,0 +1,72 @@
+#include "../src/lz4.h"
+#include <string>
+#include <vector>
+#include <random>
+
+#define BOOST_TEST_MODULE LZ4Test
+#include <boost/test/unit_test.hpp>
+
+static const std::string expected = "abcabcabcabc" "XYXYXYXYXYXYXYXYXYXYXYXYXYXYXYXYXYXYXYXY" "tail!";
+
+static const std::vector<uint8_t> block = {
+	0x35, 'a', 'b', 'c', 0x03, 0x00, // 3 literals, M=9, D=3 (overlapping match)
+	0x2F, 'X', 'Y', 0x02, 0x00, 19, // 2 literals, M=15+19+4, D=2
+	0x50, 't', 'a', 'i', 'l', '!' // last literals
+};
+
+BOOST_AUTO_TEST_CASE(LZ4Decode)
+{
+	std::vector<uint8_t> out(64);
+	int64_t rv;
+
+	rv = lz4_decode(block.data(), block.size(), out.data(), out.size());
+	BOOST_REQUIRE_EQUAL(rv, expected.size());
+	BOOST_CHECK(std::equal(expected.begin(), expected.end(), out.begin()));
+
+	// Exactly sized output buffer (no room for wide copies)
+	out.assign(expected.size(), 0);
+	rv = lz4_decode(block.data(), block.size(), out.data(), out.size());
+	BOOST_REQUIRE_EQUAL(rv, expected.size());
+	BOOST_CHECK(std::equal(expected.begin(), expected.end(), out.begin()));
+
+	// Output buffer too small
+	out.assign(20, 0);
+	BOOST_CHECK_EQUAL(lz4_decode(block.data(), block.size(), out.data(), out.size()), -1);
+
+	// Match distance beyond the start of output
+	const std::vector<uint8_t> badDistance = { 0x10, 'a', 0x02, 0x00 };
+	out.assign(64, 0);
+	BOOST_CHECK_EQUAL(lz4_decode(badDistance.data(), badDistance.size(), out.data(), out.size()), -1);
+}
+
+BOOST_AUTO_TEST_CASE(LZ4RoundTrip)
+{
+	std::mt19937 gen(1234);
+	std::uniform_int_distribution<> dis(0, 255);
+	std::vector<uint8_t> data, compressed, out;
+	size_t size;
+
+	// Text-like data with repeats, followed by noise
+	for (int i = 0; i < 50000; i++)
+		data.push_back("0123456789 abcdefghij"[(i * 7 + i / 300) % 21]);
+	for (int i = 0; i < 20000; i++)
+		data.push_back(dis(gen));
+
+	compressed.resize(lz4_compress_bound(data.size()));
+	size = lz4_compress(data.data(), data.size(), compressed.data(), compressed.size());
+	BOOST_REQUIRE(size > 0);
+	BOOST_CHECK(size < data.size() / 2);
+
+	out.resize(data.size());
+	BOOST_REQUIRE_EQUAL(lz4_decode(compressed.data(), size, out.data(), out.size()), data.size());
+	BOOST_CHECK(out == data);
+
+	// Noise alone doesn't fit into less than its own size
+	BOOST_CHECK_EQUAL(lz4_compress(&data[50000], 20000, compressed.data(), 20000), 0);
+
+	// Tiny inputs are stored as literals
+	size = lz4_compress(data.data(), 5, compressed.data(), compressed.size());
+	BOOST_REQUIRE_EQUAL(size, 6);
+	BOOST_CHECK_EQUAL(lz4_decode(compressed.data(), size, out.data(), out.size()), 5);
+	BOOST_CHECK_EQUAL(lz4_compress(data.data(), 0, compressed.data(), compressed.size()), 1);
+}
@@ -0,0 +1,59 @@
+#include "../src/lzvn.h"
+#include <string>
+#include <vector>
+
+#define BOOST_TEST_MODULE LZVNTest
+#include <boost/test/unit_test.hpp>
+
+static const std::string expected = "abcabcabcabc" "XYXYXY" "ZYZY" "ZY" "abcabcabca" "abc";
+
+static const std::vector<uint8_t> stream = {
+	0xE3, 'a', 'b', 'c', // sml_l: 3 literals
+	0x30, 0x03, // sml_d: M=9, D=3 (overlapping match)
+	0x88, 0x02, 'X', 'Y', // sml_d: 2 literals, M=4, D=2
+	0x46, 'Z', // pre_d: 1 literal, M=3
+	0xF2, // sml_m: M=2
+	0x3F, 24, 0, // lrg_d: M=10, D=24
+	0xA0, 34 << 2, 0, // med_d: M=3, D=34
+	0x0E, // nop
+	0x06, 0, 0, 0, 0, 0, 0, 0 // eos
+};
+
+BOOST_AUTO_TEST_CASE(LZVNDecode)
+{
+	std::vector<uint8_t> out(64);
+	int64_t rv;
+
+	rv = lzvn_decode(stream.data(), stream.size(), out.data(), out.size());
+	BOOST_REQUIRE_EQUAL(rv, expected.size());
+	BOOST_CHECK(std::equal(expected.begin(), expected.end(), out.begin()));
+
+	// Exactly sized output buffer (no room for wide copies)
+	out.assign(expected.size(), 0);
+	rv = lzvn_decode(stream.data(), stream.size(), out.data(), out.size());
+	BOOST_REQUIRE_EQUAL(rv, expected.size());
+	BOOST_CHECK(std::equal(expected.begin(), expected.end(), out.begin()));
+
+	// Output buffer smaller than the stream
+	out.assign(20, 0);
+	rv = lzvn_decode(stream.data(), stream.size(), out.data(), out.size());
+	BOOST_REQUIRE_EQUAL(rv, 20);
+	BOOST_CHECK(std::equal(out.begin(), out.end(), expected.begin()));
+}
+
+BOOST_AUTO_TEST_CASE(LZVNInvalid)
+{
+	std::vector<uint8_t> out(64);
+
+	// Match distance beyond the start of output
+	const std::vector<uint8_t> badDistance = { 0xE1, 'a', 0x00, 0x02, 0x06 };
+	BOOST_CHECK_EQUAL(lzvn_decode(badDistance.data(), badDistance.size(), out.data(), out.size()), -1);
+
+	// Undefined opcode
+	const std::vector<uint8_t> undefined = { 0xE1, 'a', 0x70, 0x06 };
+	BOOST_CHECK_EQUAL(lzvn_decode(undefined.data(), undefined.size(), out.data(), out.size()), -1);
+
+	// Literals running past the end of input
+	const std::vector<uint8_t> truncated = { 0xE5, 'a', 'b' };
+	BOOST_CHECK_EQUAL(lzvn_decode(truncated.data(), truncated.size(), out.data(), out.size()), -1);
+}